@@ -0,0 +1,276 @@
+/*
+ * Microbenchmarks for the storage layer.
+ *
+ *   db_bench [--dir DIR] ROWS...
+ *
+ * For each row count, runs sequential inserts, random inserts, point
+ * lookups, a warm full scan, a cold-cache full scan and random inserts in
+ * sorted batches of BATCH_SIZE rows, and prints one
+ * JSON document to stdout. Latencies are per operation (one row); pages
+ * read and written are counted by the pager while the operations run, so
+ * the final flush at close is not included.
+ */
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "util.h"
+
+#define BATCH_SIZE 1000
+
+typedef struct {
+  const char *name;
+  uint32_t rows;
+  uint64_t ops;
+  uint64_t total_ns;
+  uint64_t p50_ns;
+  uint64_t p99_ns;
+  PagerStats io;
+} Result;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*, fixed seed so runs are comparable.
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng_next(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void shuffle(uint32_t *keys, uint32_t n) {
+  for (uint32_t i = n; i > 1; i--) {
+    uint32_t j = rng_next() % i;
+    uint32_t tmp = keys[i - 1];
+    keys[i - 1] = keys[j];
+    keys[j] = tmp;
+  }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void finish(Result *r, uint64_t *lat, PagerStats before, PagerStats after) {
+  qsort(lat, r->ops, sizeof(uint64_t), cmp_u64);
+  r->total_ns = 0;
+  for (uint64_t i = 0; i < r->ops; i++) {
+    r->total_ns += lat[i];
+  }
+  r->p50_ns = r->ops ? lat[r->ops / 2] : 0;
+  r->p99_ns = r->ops ? lat[r->ops * 99 / 100] : 0;
+  r->io.pages_read = after.pages_read - before.pages_read;
+  r->io.pages_written = after.pages_written - before.pages_written;
+}
+
+static void make_row(Row *row, uint32_t key) {
+  row->id = key;
+  snprintf(row->username, sizeof(row->username), "user%u", key);
+  snprintf(row->email, sizeof(row->email), "person%u@example.com", key);
+}
+
+static void bench_insert(Result *r, const char *path, const uint32_t *keys,
+                         uint32_t n, uint64_t *lat) {
+  unlink(path);
+  Table *table = db_open(path, false);
+  PagerStats before = pager_stats(table->pager);
+  Row row;
+  for (uint32_t i = 0; i < n; i++) {
+    make_row(&row, keys[i]);
+    uint64_t start = now_ns();
+    Cursor *c = table_find(table, keys[i]);
+    leaf_node_insert(c, keys[i], &row);
+    free(c);
+    pager_unpin_all(table->pager);
+    lat[i] = now_ns() - start;
+  }
+  r->ops = n;
+  finish(r, lat, before, pager_stats(table->pager));
+  db_close(table);
+}
+
+static int cmp_row_id(const void *a, const void *b) {
+  uint32_t x = ((const Row *)a)->id;
+  uint32_t y = ((const Row *)b)->id;
+  return (x > y) - (x < y);
+}
+
+// Each row of a batch is charged the batch's time divided by its size.
+static void bench_batch_insert(Result *r, const char *path, const uint32_t *keys,
+                               uint32_t n, uint64_t *lat) {
+  unlink(path);
+  Table *table = db_open(path, false);
+  PagerStats before = pager_stats(table->pager);
+  Row *rows = malloc(BATCH_SIZE * sizeof(Row));
+  if (!rows) die("malloc");
+  for (uint32_t done = 0; done < n; done += BATCH_SIZE) {
+    uint32_t batch = n - done < BATCH_SIZE ? n - done : BATCH_SIZE;
+    for (uint32_t i = 0; i < batch; i++) {
+      make_row(&rows[i], keys[done + i]);
+    }
+    uint64_t start = now_ns();
+    qsort(rows, batch, sizeof(Row), cmp_row_id);
+    if (!table_insert_sorted(table, rows, batch)) {
+      fprintf(stderr, "batch insert found a duplicate key\n");
+      exit(EXIT_FAILURE);
+    }
+    uint64_t per_row = (now_ns() - start) / batch;
+    for (uint32_t i = 0; i < batch; i++) {
+      lat[done + i] = per_row;
+    }
+  }
+  free(rows);
+  r->ops = n;
+  finish(r, lat, before, pager_stats(table->pager));
+  db_close(table);
+}
+
+static void bench_lookup(Result *r, const char *path, const uint32_t *keys,
+                         uint32_t n, uint64_t *lat) {
+  Table *table = db_open(path, false);
+  PagerStats before = pager_stats(table->pager);
+  Row row;
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t start = now_ns();
+    Cursor *c = table_lookup(table, NULL, keys[i], true);
+    deserialize_row(cursor_get_slot(c), &row);
+    free(c);
+    pager_unpin_all(table->pager);
+    lat[i] = now_ns() - start;
+    if (row.id != keys[i]) {
+      fprintf(stderr, "lookup of %u returned %u\n", keys[i], row.id);
+      exit(EXIT_FAILURE);
+    }
+  }
+  r->ops = n;
+  finish(r, lat, before, pager_stats(table->pager));
+  db_close(table);
+}
+
+static void bench_scan(Result *r, const char *path, uint32_t n, uint64_t *lat) {
+  Table *table = db_open(path, false);
+  PagerStats before = pager_stats(table->pager);
+  Row row;
+  uint64_t count = 0;
+  uint64_t start = now_ns();
+  Cursor *c = table_start(table, NULL);
+  while (!c->end_of_table) {
+    deserialize_row(cursor_get_slot(c), &row);
+    cursor_advance(c);
+    pager_unpin_all(table->pager);
+    uint64_t end = now_ns();
+    if (count < n) lat[count] = end - start;
+    count++;
+    start = end;
+  }
+  free(c);
+  if (count != n) {
+    fprintf(stderr, "scan returned %" PRIu64 " rows, expected %u\n", count, n);
+    exit(EXIT_FAILURE);
+  }
+  r->ops = count;
+  finish(r, lat, before, pager_stats(table->pager));
+  db_close(table);
+}
+
+// Evict the file from the OS page cache so the next scan reads the disk.
+static void drop_os_cache(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) die("open");
+  if (fdatasync(fd) == -1) die("fdatasync");
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static void print_result(const Result *r, bool first) {
+  double seconds = r->total_ns / 1e9;
+  printf("%s    {\"name\": \"%s\", \"rows\": %u, \"ops\": %" PRIu64 ", "
+         "\"seconds\": %.6f, \"ops_per_sec\": %.0f, "
+         "\"p50_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", "
+         "\"pages_read\": %" PRIu64 ", \"pages_written\": %" PRIu64 "}",
+         first ? "" : ",\n", r->name, r->rows, r->ops, seconds,
+         seconds > 0 ? r->ops / seconds : 0.0, r->p50_ns, r->p99_ns,
+         r->io.pages_read, r->io.pages_written);
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: db_bench [--dir DIR] ROWS...\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir = ".";
+  int first_arg = 1;
+  if (argc > 2 && strcmp(argv[1], "--dir") == 0) {
+    dir = argv[2];
+    first_arg = 3;
+  }
+  if (first_arg >= argc) usage();
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/bench.db", dir);
+
+  printf("{\n  \"results\": [\n");
+  bool first = true;
+  for (int a = first_arg; a < argc; a++) {
+    char *end;
+    unsigned long n = strtoul(argv[a], &end, 10);
+    if (*end != '\0' || n == 0 || n >= UINT32_MAX) usage();
+
+    uint32_t *keys = malloc(n * sizeof(uint32_t));
+    uint64_t *lat = malloc(n * sizeof(uint64_t));
+    if (!keys || !lat) die("malloc");
+    for (uint32_t i = 0; i < n; i++) {
+      keys[i] = i;
+    }
+
+    Result r = {.rows = n};
+    r.name = "seq_insert";
+    bench_insert(&r, path, keys, n, lat);
+    print_result(&r, first);
+    first = false;
+
+    shuffle(keys, n);
+    r.name = "random_insert";
+    bench_insert(&r, path, keys, n, lat);
+    print_result(&r, false);
+
+    shuffle(keys, n);
+    r.name = "point_lookup";
+    bench_lookup(&r, path, keys, n, lat);
+    print_result(&r, false);
+
+    r.name = "full_scan";
+    bench_scan(&r, path, n, lat);
+    print_result(&r, false);
+
+    drop_os_cache(path);
+    r.name = "cold_scan";
+    bench_scan(&r, path, n, lat);
+    print_result(&r, false);
+
+    r.name = "batch_insert";
+    bench_batch_insert(&r, path, keys, n, lat);
+    print_result(&r, false);
+
+    free(keys);
+    free(lat);
+    fflush(stdout);
+  }
+  printf("\n  ]\n}\n");
+  unlink(path);
+  return 0;
+}
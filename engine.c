@@ -1,53 +1,259 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <string.h>
 #include "engine.h"
+#include "profile.h"
+#include "sort.h"
 #include "storage.h"
 
+static int compare_row_ids(const void *a, const void *b) {
+  uint32_t x = ((const Row *)a)->id;
+  uint32_t y = ((const Row *)b)->id;
+  return (x > y) - (x < y);
+}
+
+// The rows are sorted and inserted as one batch. A key that is already in
+// the table, or repeated within the statement, fails it before anything is
+// inserted.
 static ExecuteResult execute_insert(Statement *stmt, Table *table) {
-  void *node = get_page(table->pager, table->root_page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint32_t num_rows = stmt->num_rows;
+  Row *rows = &stmt->row_to_insert;
+  if (num_rows > 1) {
+    rows = malloc(num_rows * sizeof(Row));
+    if (!rows) die("malloc");
+    uint32_t i = 0;
+    do {
+      rows[i++] = stmt->row_to_insert;
+    } while (statement_next_row(stmt));
+    qsort(rows, num_rows, sizeof(Row), compare_row_ids);
+  }
 
-  Row *row_to_insert = &(stmt->row_to_insert);
-  uint32_t key_to_insert = row_to_insert->id;
-  Cursor *c = table_find(table, key_to_insert);
+  ExecuteResult result = EXECUTE_SUCCESS;
+  if (!table_insert_sorted(table, rows, num_rows)) {
+    result = EXECUTE_DUPLICATE_KEY;
+  }
 
-  if (c->cell_num < num_cells) {
-    uint32_t key_at_index = *leaf_node_key(node, c->cell_num);
-    if (key_at_index == key_to_insert) {
-      return EXECUTE_DUPLICATE_KEY;
-    }
+  if (rows != &stmt->row_to_insert) {
+    free(rows);
   }
+  return result;
+}
+
+// Reads see the committed tree, unless this session's own transaction is
+// open. Returns NULL in that case.
+static Snapshot *session_snapshot(Session *s) {
+  return s->in_transaction ? NULL : db_snapshot(s->table);
+}
 
-  leaf_node_insert(c, row_to_insert->id, row_to_insert);
+static void session_snapshot_release(Session *s, Snapshot *snap) {
+  pager_unpin_all(s->table->pager);
+  if (snap) {
+    snapshot_release(snap);
+  }
+}
 
+static void execute_select_by_id(Statement *stmt, Session *s, Snapshot *snap, FILE *out) {
+  Cursor *c = table_lookup(s->table, snap, stmt->filter_id, s->hot_index);
+  if (!c->end_of_table) {
+    Row row;
+    deserialize_row(cursor_get_slot(c), &row);
+    if (row.id == stmt->filter_id) {
+      print_row(out, &row);
+    }
+  }
   free(c);
+}
 
-  return EXECUTE_SUCCESS;
+/*
+ * A select that walks the leaves. It runs a leaf at a time, and in server
+ * mode stops in between, keeping its cursor and snapshot here. An ordered
+ * one then prints its sorted rows a leaf's worth at a time.
+ */
+struct Scan_tag {
+  Snapshot *snap; // NULL in the session's own transaction
+  Cursor *cursor;
+  bool filtered;
+  ColumnFilter filter;
+  Sorter *sorter; // NULL unless ordered
+  bool sorted;    // the leaves are done, the sorter has the rows
+  bool has_limit;
+  uint32_t limit;
+  uint32_t printed;
+  uint64_t parse_ns;
+  uint64_t execute_ns; // summed over the leaves
+  uint64_t phase_ns[NUM_PHASES];
+};
+
+static Scan *scan_new(Statement *stmt, Session *s, Snapshot *snap) {
+  Scan *scan = calloc(1, sizeof(Scan));
+  if (!scan) die("calloc");
+  scan->snap = snap;
+  scan->cursor = table_start(s->table, snap);
+  scan->has_limit = stmt->has_limit;
+  scan->limit = stmt->limit;
+
+  // Username and email are compared in the leaves, before a row is copied.
+  scan->filtered = stmt->filter != FILTER_NONE;
+  if (scan->filtered) {
+    Column column = stmt->filter == FILTER_USERNAME ? COLUMN_USERNAME : COLUMN_EMAIL;
+    if (!column_filter_init(&scan->filter, column, stmt->filter_value.start,
+                            stmt->filter_value.len, stmt->filter_prefix)) {
+      scan->cursor->end_of_table = true; // no row can pass
+    }
+  }
+
+  // Sorted rows are printed once the scan is done, so it cannot stop early.
+  if (stmt->has_order) {
+    scan->sorter = sorter_new(stmt->order_by, stmt->has_limit ? stmt->limit : UINT32_MAX,
+                              s->sort_memory);
+  }
+  return scan;
 }
 
-static ExecuteResult execute_select(Statement *stmt, Table *table) {
-  Cursor *c = table_start(table);
+static void scan_free(Scan *scan) {
+  free(scan->cursor);
+  if (scan->sorter) {
+    sorter_free(scan->sorter);
+  }
+  if (scan->snap) {
+    snapshot_release(scan->snap);
+  }
+  free(scan);
+}
+
+// Unsorted rows stop at the limit; sorted ones only once all are seen.
+static bool scan_at_limit(Scan *scan) {
+  return !scan->sorter && scan->has_limit && scan->printed == scan->limit;
+}
+
+// Prints up to a leaf's worth of sorted rows. Returns true once all are.
+static bool scan_print_sorted(Scan *scan, FILE *out) {
   Row row;
-  while (!c->end_of_table) {
+  for (uint32_t i = 0; i < LEAF_NODE_MAX_CELLS; i++) {
+    if (!sorter_next(scan->sorter, &row)) {
+      return true;
+    }
+    print_row(out, &row);
+  }
+  return false;
+}
+
+// Runs the scan over the rest of the leaf its cursor is on, or prints the
+// next of its sorted rows. Returns true once it is done.
+static bool scan_step(Scan *scan, Table *table, FILE *out) {
+  if (scan->sorted) {
+    return scan_print_sorted(scan, out);
+  }
+
+  Cursor *c = scan->cursor;
+  uint32_t page_num = c->page_num;
+  Row row;
+  while (!c->end_of_table && c->page_num == page_num && !scan_at_limit(scan)) {
+    if (scan->filtered && !cursor_seek_match(c, &scan->filter)) {
+      break;
+    }
     deserialize_row(cursor_get_slot(c), &row);
-    print_row(&row);
+    if (scan->sorter) {
+      sorter_add(scan->sorter, &row);
+    } else {
+      print_row(out, &row);
+      scan->printed++;
+    }
     cursor_advance(c);
   }
-  free(c);
+  pager_unpin_all(table->pager);
+  if (!c->end_of_table && !scan_at_limit(scan)) {
+    return false;
+  }
+  if (!scan->sorter) {
+    return true;
+  }
+  sorter_finish(scan->sorter);
+  scan->sorted = true;
+  // Every row is in the sorter now, so the pages need not be kept.
+  if (scan->snap) {
+    snapshot_release(scan->snap);
+    scan->snap = NULL;
+  }
+  return scan_print_sorted(scan, out);
+}
+
+static ExecuteResult execute_select(Statement *stmt, Session *s, FILE *out) {
+  Table *table = s->table;
+  Snapshot *snap = session_snapshot(s);
+  if (stmt->filter == FILTER_ID) {
+    if (!stmt->has_limit || stmt->limit > 0) {
+      execute_select_by_id(stmt, s, snap, out);
+    }
+    session_snapshot_release(s, snap);
+    return EXECUTE_SUCCESS;
+  }
+
+  Scan *scan = scan_new(stmt, s, snap);
+  while (!scan_step(scan, table, out)) {
+    if (s->pause_scans) {
+      s->scan = scan;
+      return EXECUTE_PAUSED;
+    }
+  }
+  scan_free(scan);
+  return EXECUTE_SUCCESS;
+}
+
+static ExecuteResult execute_begin(Statement *stmt, Session *s) {
+  if (s->in_transaction) {
+    return EXECUTE_TRANSACTION_ACTIVE;
+  }
+  db_begin(s->table);
+  s->in_transaction = true;
+  return EXECUTE_SUCCESS;
+}
+
+static ExecuteResult execute_commit(Statement *stmt, Session *s) {
+  if (!s->in_transaction) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+  db_commit(s->table);
+  s->in_transaction = false;
   return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_statement(Statement *stmt, Table *table) {
+static ExecuteResult execute_rollback(Statement *stmt, Session *s) {
+  if (!s->in_transaction) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+  db_rollback(s->table);
+  s->in_transaction = false;
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement(Statement *stmt, Session *s, FILE *out) {
+  Table *table = s->table;
+  ExecuteResult result;
   switch (stmt->type) {
   case STATEMENT_INSERT:
-    return execute_insert(stmt, table);
+    result = execute_insert(stmt, table);
+    break;
   case (STATEMENT_SELECT):
-    return execute_select(stmt, table);
+    result = execute_select(stmt, s, out);
+    break;
+  case STATEMENT_BEGIN:
+    result = execute_begin(stmt, s);
+    break;
+  case STATEMENT_COMMIT:
+    result = execute_commit(stmt, s);
+    break;
+  case STATEMENT_ROLLBACK:
+    result = execute_rollback(stmt, s);
+    break;
   default:
     assert(false);
   }
+  pager_unpin_all(table->pager);
+  return result;
 }
 
 void do_exit(InputBuffer *b, Table *table) {
@@ -56,17 +262,266 @@ void do_exit(InputBuffer *b, Table *table) {
   exit(EXIT_SUCCESS);
 }
 
-MetaCommandResult do_meta_command(InputBuffer *b, Table *table) {
+typedef struct {
+  const char *name;
+  uint64_t value;
+} Stat;
+
+// Prints one "name: value" line per counter, or a single JSON object.
+static void print_stats(Table *table, Snapshot *snap, bool json, FILE *out) {
+  PagerStats ps = pager_stats(table->pager);
+  TreeStats ts = table->stats;
+  Stat stats[] = {
+    {"cache_hits", ps.hits},
+    {"cache_misses", ps.misses},
+    {"cached_pages", ps.cached_pages},
+    {"cache_capacity", ps.cache_capacity},
+    {"pages_read", ps.pages_read},
+    {"pages_written", ps.pages_written},
+    {"flushes", ps.flushes},
+    {"bytes_read", ps.bytes_read},
+    {"bytes_written", ps.bytes_written},
+    {"file_pages", ps.file_pages},
+    {"shadow_pages", ps.shadow_pages},
+    {"leaf_splits", ts.leaf_splits},
+    {"internal_splits", ts.internal_splits},
+    {"root_promotions", ts.root_promotions},
+    {"descents", ts.descents},
+    {"descent_nodes", ts.descent_nodes},
+    {"tree_height", table_height(table, snap)},
+  };
+  uint32_t num_stats = sizeof(stats) / sizeof(stats[0]);
+
+  if (!json) {
+    fprintf(out, "Stats:\n");
+  }
+  for (uint32_t i = 0; i < num_stats; i++) {
+    if (json) {
+      fprintf(out, "%s\"%s\": %" PRIu64, i == 0 ? "{" : ", ", stats[i].name, stats[i].value);
+    } else {
+      fprintf(out, "%s: %" PRIu64 "\n", stats[i].name, stats[i].value);
+    }
+  }
+  if (json) {
+    fprintf(out, "}\n");
+  }
+}
+
+static const char *const STATEMENT_NAMES[] = {
+  [STATEMENT_INSERT] = "insert",
+  [STATEMENT_SELECT] = "select",
+  [STATEMENT_BEGIN] = "begin",
+  [STATEMENT_COMMIT] = "commit",
+  [STATEMENT_ROLLBACK] = "rollback",
+};
+
+// One line per statement type and phase that has been recorded.
+static void print_profile(FILE *out) {
+  fprintf(out, "Profile (ns):\n");
+  fprintf(out, "%-9s %-12s %8s %10s %10s %10s %10s %10s\n",
+         "statement", "phase", "count", "p50", "p90", "p99", "p99.9", "max");
+  uint32_t num_types = sizeof(STATEMENT_NAMES) / sizeof(STATEMENT_NAMES[0]);
+  for (uint32_t type = 0; type < num_types; type++) {
+    for (Phase phase = 0; phase < NUM_PHASES; phase++) {
+      const Histogram *h = profile_histogram(type, phase);
+      if (h->count == 0) {
+        continue;
+      }
+      fprintf(out, "%-9s %-12s %8" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+             " %10" PRIu64 " %10" PRIu64 "\n",
+             STATEMENT_NAMES[type], PHASE_NAMES[phase], h->count,
+             histogram_percentile(h, 50), histogram_percentile(h, 90),
+             histogram_percentile(h, 99), histogram_percentile(h, 99.9),
+             h->max);
+    }
+  }
+}
+
+MetaCommandResult do_meta_command(InputBuffer *b, Session *s, FILE *out) {
+  Table *table = s->table;
   if (strcmp(b->buf, ".exit") == 0) {
-    do_exit(b, table);
+    return META_COMMAND_EXIT;
   } else if (strcmp(b->buf, ".constants") == 0) {
-    printf("Constants:\n");
-    print_constants();
+    fprintf(out, "Constants:\n");
+    print_constants(out);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(b->buf, ".hotindex on") == 0) {
+    s->hot_index = true;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(b->buf, ".hotindex off") == 0) {
+    s->hot_index = false;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(b->buf, ".timer on") == 0) {
+    s->timer = true;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(b->buf, ".timer off") == 0) {
+    s->timer = false;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(b->buf, ".profile on") == 0) {
+    s->profile = true;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(b->buf, ".profile off") == 0) {
+    s->profile = false;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(b->buf, ".profile reset") == 0) {
+    profile_reset();
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(b->buf, ".profile") == 0) {
+    print_profile(out);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(b->buf, ".stats") == 0 || strcmp(b->buf, ".stats json") == 0) {
+    Snapshot *snap = session_snapshot(s);
+    print_stats(table, snap, b->buf[6] != '\0', out);
+    session_snapshot_release(s, snap);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(b->buf, ".sort_memory") == 0) {
+    fprintf(out, "Sort memory: %zu KiB\n", s->sort_memory >> 10);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(b->buf, ".sort_memory ", 13) == 0) {
+    char *end;
+    unsigned long long kib = strtoull(b->buf + 13, &end, 10);
+    if (end == b->buf + 13 || *end != '\0' || kib == 0 || kib > SIZE_MAX >> 10) {
+      fprintf(out, "Usage: .sort_memory [KiB]\n");
+    } else {
+      s->sort_memory = kib << 10;
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(b->buf, ".backup ", 8) == 0) {
+    const char *path = b->buf + 8;
+    if (*path == '\0') {
+      fprintf(out, "Usage: .backup <path>\n");
+    } else if (db_in_transaction(table)) {
+      fprintf(out, "Error: Cannot back up while a transaction is open.\n");
+    } else if (!db_backup(table, path)) {
+      fprintf(out, "Error: Could not back up to '%s': %s.\n", path, strerror(errno));
+    }
     return META_COMMAND_SUCCESS;
   } else if (strcmp(b->buf, ".btree") == 0) {
-    printf("Tree:\n");
-    print_tree(table->pager, 0, 0);
+    Snapshot *snap = session_snapshot(s);
+    fprintf(out, "Tree:\n");
+    print_tree(out, table, snap, 0, 0);
+    session_snapshot_release(s, snap);
     return META_COMMAND_SUCCESS;
   }
   return META_COMMAND_UNRECOGNIZED_COMMAND;
 }
+
+// Ends the output of a statement that has run.
+static void report_result(Session *s, ExecuteResult result, StatementType type,
+                          uint64_t parse_ns, uint64_t execute_ns, FILE *out) {
+  switch (result) {
+  case EXECUTE_SUCCESS:
+    fprintf(out, "Executed.\n");
+    break;
+  case EXECUTE_TABLE_FULL:
+    fprintf(out, "Error: Table full.\n");
+    break;
+  case EXECUTE_DUPLICATE_KEY:
+    fprintf(out, "Error: Duplicate key.\n");
+    break;
+  case EXECUTE_TRANSACTION_ACTIVE:
+    fprintf(out, "Error: Transaction already active.\n");
+    break;
+  case EXECUTE_NO_TRANSACTION:
+    fprintf(out, "Error: No transaction is active.\n");
+    break;
+  case EXECUTE_PAUSED:
+    assert(false);
+  }
+  if (s->timer) {
+    fprintf(out, "Time: parse %.3f ms, execute %.3f ms\n", parse_ns / 1e6, execute_ns / 1e6);
+  }
+  profile_end_statement(type, parse_ns, execute_ns);
+}
+
+CommandResult run_command(InputBuffer *b, Session *s, FILE *out) {
+  if (b->buf[0] == '.') {
+    switch (do_meta_command(b, s, out)) {
+    case META_COMMAND_SUCCESS:
+      return COMMAND_DONE;
+    case META_COMMAND_EXIT:
+      return COMMAND_EXIT;
+    case META_COMMAND_UNRECOGNIZED_COMMAND:
+      fprintf(out, "Unrecognized command '%s'.\n", b->buf);
+      return COMMAND_DONE;
+    }
+  }
+
+  profile_enabled = s->profile;
+  profile_begin_statement();
+  uint64_t parse_start = profile_now();
+  Statement stmt;
+  PrepareResult prepared = prepare_statement(b, &stmt);
+  uint64_t parse_ns = profile_now() - parse_start;
+  switch (prepared) {
+  case PREPARE_SUCCESS:
+    break;
+  case PREPARE_UNRECOGNIZED_STATEMENT:
+    fprintf(out, "Unrecognized keyword at start of '%s'.\n", b->buf);
+    return COMMAND_DONE;
+  case PREPARE_SYNTAX_ERROR:
+    fprintf(out, "Syntax error. Could not parse statement '%s'\n", b->buf);
+    return COMMAND_DONE;
+  case PREPARE_STRING_TOO_LONG:
+    fprintf(out, "String is too long.\n");
+    return COMMAND_DONE;
+  case PREPARE_NEGATIVE_ID:
+    fprintf(out, "ID must be positive.\n");
+    return COMMAND_DONE;
+  }
+
+  // Only the session that owns the open transaction may write; the others
+  // read their snapshots and wait for it to end before writing.
+  if (db_in_transaction(s->table) && !s->in_transaction
+      && stmt.type != STATEMENT_SELECT) {
+    return COMMAND_BLOCKED;
+  }
+
+  uint64_t execute_start = profile_now();
+  ExecuteResult result = execute_statement(&stmt, s, out);
+  uint64_t execute_ns = profile_now() - execute_start;
+  if (result == EXECUTE_PAUSED) {
+    s->scan->parse_ns = parse_ns;
+    s->scan->execute_ns = execute_ns;
+    memcpy(s->scan->phase_ns, profile_phase_ns, sizeof(profile_phase_ns));
+    return COMMAND_PAUSED;
+  }
+  report_result(s, result, stmt.type, parse_ns, execute_ns, out);
+  return COMMAND_DONE;
+}
+
+CommandResult resume_command(Session *s, FILE *out) {
+  Scan *scan = s->scan;
+  profile_enabled = s->profile;
+  memcpy(profile_phase_ns, scan->phase_ns, sizeof(profile_phase_ns));
+  uint64_t start = profile_now();
+  bool done = scan_step(scan, s->table, out);
+  scan->execute_ns += profile_now() - start;
+  if (!done) {
+    memcpy(scan->phase_ns, profile_phase_ns, sizeof(profile_phase_ns));
+    return COMMAND_PAUSED;
+  }
+  report_result(s, EXECUTE_SUCCESS, STATEMENT_SELECT, scan->parse_ns, scan->execute_ns, out);
+  scan_free(scan);
+  s->scan = NULL;
+  return COMMAND_DONE;
+}
+
+void session_init(Session *s, Table *table) {
+  *s = (Session){
+    .table = table,
+    .hot_index = true,
+    .sort_memory = SORT_MEMORY_DEFAULT,
+  };
+}
+
+void session_end(Session *s) {
+  if (s->scan) {
+    scan_free(s->scan);
+    s->scan = NULL;
+  }
+  if (s->in_transaction) {
+    db_rollback(s->table);
+    s->in_transaction = false;
+  }
+}
@@ -1,21 +1,63 @@
 #pragma once
 
+#include <stdio.h>
 #include "storage.h"
 #include "query.h"
 #include "util.h"
 
+// A select that stopped between leaves, see run_command.
+typedef struct Scan_tag Scan;
+
+// A client of the table: the REPL, or a connection in server mode.
+typedef struct {
+  Table *table;
+  bool in_transaction; // owns the table's open transaction
+  bool pause_scans;    // selects stop after each leaf
+  Scan *scan;          // the select that stopped, NULL if none
+  // Set by the meta commands of the same names.
+  bool hot_index;
+  bool timer;
+  bool profile;
+  size_t sort_memory;
+} Session;
+
+// A session with the default settings and no transaction.
+void session_init(Session *s, Table *table);
+
 typedef enum {
   EXECUTE_SUCCESS,
   EXECUTE_TABLE_FULL,
   EXECUTE_DUPLICATE_KEY,
+  EXECUTE_TRANSACTION_ACTIVE,
+  EXECUTE_NO_TRANSACTION,
+  EXECUTE_PAUSED,
 } ExecuteResult;
 
-ExecuteResult execute_statement(Statement *stmt, Table *table);
+ExecuteResult execute_statement(Statement *stmt, Session *s, FILE *out);
 
 typedef enum {
   META_COMMAND_SUCCESS,
   META_COMMAND_UNRECOGNIZED_COMMAND,
+  META_COMMAND_EXIT,
 } MetaCommandResult;
 
 void do_exit(InputBuffer *b, Table *table);
-MetaCommandResult do_meta_command(InputBuffer *b, Table *table);
+MetaCommandResult do_meta_command(InputBuffer *b, Session *s, FILE *out);
+
+typedef enum {
+  COMMAND_DONE,
+  COMMAND_EXIT,
+  COMMAND_BLOCKED, // another session's transaction is open, retry later
+  COMMAND_PAUSED,  // a select stopped between leaves, see resume_command
+} CommandResult;
+
+// Runs one line of input and writes its output to out. A blocked command
+// has not run and wrote nothing. With pause_scans set, a select that
+// walks the leaves stops after each one, so that other sessions can run
+// in between; it keeps reading its snapshot, whatever they write.
+CommandResult run_command(InputBuffer *b, Session *s, FILE *out);
+// Runs the session's stopped select over its next leaf, or prints the
+// next of its sorted rows.
+CommandResult resume_command(Session *s, FILE *out);
+// Drops the session's stopped select and rolls back its transaction.
+void session_end(Session *s);
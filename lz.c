@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // the block always ends with literals
+#define MATCH_LIMIT 12  // no match starts this close to the end
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+size_t lz_compress_bound(size_t n) {
+  return n + n / 255 + 16;
+}
+
+// Emits a length of 15 or more as 255-valued bytes and a remainder.
+static uint8_t *write_length(uint8_t *op, uint8_t *oend, size_t len) {
+  for (len -= 15; len >= 255; len -= 255) {
+    if (op >= oend) return NULL;
+    *op++ = 255;
+  }
+  if (op >= oend) return NULL;
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+static uint8_t *write_sequence(
+  uint8_t *op,
+  uint8_t *oend,
+  const uint8_t *literals,
+  size_t literal_len,
+  size_t offset,
+  size_t match_len // 0 for the last sequence
+) {
+  if (op >= oend) return NULL;
+  uint8_t *token = op++;
+  *token = (literal_len < 15 ? literal_len : 15) << 4;
+  if (literal_len >= 15 && !(op = write_length(op, oend, literal_len))) {
+    return NULL;
+  }
+  if ((size_t)(oend - op) < literal_len) return NULL;
+  memcpy(op, literals, literal_len);
+  op += literal_len;
+  if (match_len == 0) {
+    return op;
+  }
+
+  if (oend - op < 2) return NULL;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  size_t len = match_len - MIN_MATCH;
+  *token |= len < 15 ? len : 15;
+  if (len >= 15 && !(op = write_length(op, oend, len))) {
+    return NULL;
+  }
+  return op;
+}
+
+size_t lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap) {
+  const uint8_t *in = src;
+  const uint8_t *end = in + src_len;
+  const uint8_t *ip = in;
+  const uint8_t *anchor = in;
+  uint8_t *op = dst;
+  uint8_t *oend = op + dst_cap;
+  uint16_t table[1 << HASH_BITS] = {0};
+
+  if (src_len > MAX_OFFSET + 1) {
+    return 0;
+  }
+
+  if (src_len > MATCH_LIMIT) {
+    const uint8_t *match_limit = end - MATCH_LIMIT;
+    while (ip < match_limit) {
+      uint32_t h = hash(read32(ip));
+      const uint8_t *ref = in + table[h];
+      table[h] = ip - in;
+      if (ref >= ip || read32(ref) != read32(ip)) {
+        ip++;
+        continue;
+      }
+
+      const uint8_t *mp = ip + MIN_MATCH;
+      const uint8_t *rp = ref + MIN_MATCH;
+      while (mp < end - LAST_LITERALS && *mp == *rp) {
+        mp++;
+        rp++;
+      }
+      op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+      if (!op) return 0;
+      ip = anchor = mp;
+    }
+  }
+
+  op = write_sequence(op, oend, anchor, end - anchor, 0, 0);
+  if (!op) return 0;
+  return op - (uint8_t *)dst;
+}
+
+// Reads a length extension. Returns false on a truncated input.
+static bool read_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip >= iend) return false;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+bool lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_len) {
+  const uint8_t *ip = src;
+  const uint8_t *iend = ip + src_len;
+  uint8_t *op = dst;
+  uint8_t *oend = op + dst_len;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && !read_length(&ip, iend, &literal_len)) {
+      return false;
+    }
+    if ((size_t)(iend - ip) < literal_len || (size_t)(oend - op) < literal_len) {
+      return false;
+    }
+    memcpy(op, ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+    if (ip == iend) {
+      break; // last sequence has no match
+    }
+
+    if (iend - ip < 2) return false;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) {
+      return false;
+    }
+    size_t match_len = token & 15;
+    if (match_len == 15 && !read_length(&ip, iend, &match_len)) {
+      return false;
+    }
+    match_len += MIN_MATCH;
+    if ((size_t)(oend - op) < match_len) {
+      return false;
+    }
+    // Byte by byte: the match may overlap the bytes it produces.
+    const uint8_t *ref = op - offset;
+    for (size_t i = 0; i < match_len; i++) {
+      op[i] = ref[i];
+    }
+    op += match_len;
+  }
+
+  return op == oend;
+}
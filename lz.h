@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * LZ4-style block compression: a sequence is a token, literals, a 2-byte
+ * offset and a match length. Inputs are limited to 64 KiB.
+ */
+
+// Worst case size of compressing n bytes.
+size_t lz_compress_bound(size_t n);
+
+// Returns the compressed size, or 0 if it does not fit in dst_cap.
+size_t lz_compress(const void *src, size_t src_len, void *dst, size_t dst_cap);
+
+// Returns false unless src decodes to exactly dst_len bytes.
+bool lz_decompress(const void *src, size_t src_len, void *dst, size_t dst_len);
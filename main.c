@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "util.h"
 #include "query.h"
 #include "engine.h"
+#include "server.h"
 #include "storage.h"
 
 static void print_prompt() {
@@ -25,59 +27,48 @@ static bool read_input(InputBuffer *b) {
   return true;
 }
 
+static void usage(void) {
+  fprintf(stderr, "Usage: db [--compress] [--serve <socket>] <filename>\n");
+  exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv) {
-  if (argc < 2) {
+  char *filename = NULL;
+  char *socket_path = NULL;
+  bool compress = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--compress") == 0) {
+      compress = true;
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (argv[i][0] == '-' || filename) {
+      usage();
+    } else {
+      filename = argv[i];
+    }
+  }
+  if (!filename) {
     fprintf(stderr, "Must supply a database filename.\n");
-    exit(EXIT_FAILURE);
+    usage();
+  }
+
+  Table *table = db_open(filename, compress);
+  if (socket_path) {
+    serve(table, socket_path);
+    db_close(table);
+    return 0;
   }
 
-  char *filename = argv[1];
-  Table *table = db_open(filename);
+  Session session;
+  session_init(&session, table);
   InputBuffer *b = new_input_buffer();
   for (;;) {
     print_prompt();
     if (!read_input(b)) {
       do_exit(b, table);
     }
-
-    if (b->buf[0] == '.') {
-      switch (do_meta_command(b, table)) {
-      case META_COMMAND_SUCCESS:
-        continue;
-      case META_COMMAND_UNRECOGNIZED_COMMAND:
-        printf("Unrecognized command '%s'.\n", b->buf);
-        continue;
-      }
-    }
-
-    Statement stmt;
-    switch (prepare_statement(b, &stmt)) {
-    case PREPARE_SUCCESS:
-      break;
-    case PREPARE_UNRECOGNIZED_STATEMENT:
-      printf("Unrecognized keyword at start of '%s'.\n", b->buf);
-      continue;
-    case PREPARE_SYNTAX_ERROR:
-      printf("Syntax error. Could not parse statement '%s'\n", b->buf);
-      continue;
-    case PREPARE_STRING_TOO_LONG:
-      printf("String is too long.\n");
-      continue;
-    case PREPARE_NEGATIVE_ID:
-      printf("ID must be positive.\n");
-      continue;
-    }
-
-    switch (execute_statement(&stmt, table)) {
-    case EXECUTE_SUCCESS:
-      printf("Executed.\n");
-      break;
-    case EXECUTE_TABLE_FULL:
-      printf("Error: Table full.\n");
-      break;
-    case EXECUTE_DUPLICATE_KEY:
-      printf("Error: Duplicate key.\n");
-      break;
+    if (run_command(b, &session, stdout) == COMMAND_EXIT) {
+      do_exit(b, table);
     }
   }
 }
@@ -0,0 +1,65 @@
+#include <string.h>
+#include "match.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+typedef bool (*MatchFn)(const char *s, const char *pattern, uint32_t len);
+
+static bool match_scalar(const char *s, const char *pattern, uint32_t len) {
+  return memcmp(s, pattern, len) == 0;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static bool match_sse42(const char *s, const char *pattern, uint32_t len) {
+  for (uint32_t i = 0; i < len; i += 16) {
+    int n = len - i < 16 ? len - i : 16;
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(pattern + i));
+    // The carry flag is set if any of the first n bytes differ.
+    if (_mm_cmpestrc(a, n, b, n,
+                     _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_EACH | _SIDD_NEGATIVE_POLARITY)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+__attribute__((target("avx2")))
+static bool match_avx2(const char *s, const char *pattern, uint32_t len) {
+  for (uint32_t i = 0; i < len; i += 32) {
+    uint32_t n = len - i;
+    uint32_t need = n >= 32 ? UINT32_MAX : (1u << n) - 1;
+    __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(pattern + i));
+    uint32_t equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    if ((equal & need) != need) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+static MatchFn match_impl;
+
+static MatchFn match_select(void) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    return match_avx2;
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    return match_sse42;
+  }
+#endif
+  return match_scalar;
+}
+
+bool match_bytes(const void *s, const void *pattern, uint32_t len) {
+  if (match_impl == NULL) {
+    match_impl = match_select();
+  }
+  return match_impl(s, pattern, len);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// match_bytes reads whole blocks of this many bytes.
+#define MATCH_BLOCK_SIZE 32
+
+/*
+ * Returns whether the first len bytes of s and pattern are equal. Uses
+ * AVX2 or SSE4.2 when the CPU has them and memcmp otherwise. Both buffers
+ * must be readable up to len rounded up to MATCH_BLOCK_SIZE.
+ */
+bool match_bytes(const void *s, const void *pattern, uint32_t len);
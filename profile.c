@@ -0,0 +1,93 @@
+#include <string.h>
+#include <time.h>
+#include "profile.h"
+
+#define HISTOGRAM_SUB_COUNT (1u << HISTOGRAM_SUB_BITS)
+
+static uint32_t histogram_index(uint64_t value) {
+  if (value < HISTOGRAM_SUB_COUNT) {
+    return value;
+  }
+  uint32_t msb = 63 - __builtin_clzll(value);
+  uint32_t shift = msb - HISTOGRAM_SUB_BITS;
+  uint32_t idx = (shift + 1) * HISTOGRAM_SUB_COUNT
+    + ((value >> shift) & (HISTOGRAM_SUB_COUNT - 1));
+  return idx < HISTOGRAM_BUCKETS ? idx : HISTOGRAM_BUCKETS - 1;
+}
+
+static uint64_t histogram_bucket_max(uint32_t idx) {
+  if (idx < HISTOGRAM_SUB_COUNT) {
+    return idx;
+  }
+  uint32_t shift = idx / HISTOGRAM_SUB_COUNT - 1;
+  uint64_t low = (uint64_t)(HISTOGRAM_SUB_COUNT + idx % HISTOGRAM_SUB_COUNT) << shift;
+  return low + ((uint64_t)1 << shift) - 1;
+}
+
+void histogram_record(Histogram *h, uint64_t value) {
+  h->buckets[histogram_index(value)]++;
+  h->count++;
+  if (value > h->max) {
+    h->max = value;
+  }
+}
+
+uint64_t histogram_percentile(const Histogram *h, double pct) {
+  if (h->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(h->count * pct / 100.0 + 0.5);
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t max = histogram_bucket_max(i);
+      return max < h->max ? max : h->max;
+    }
+  }
+  return h->max;
+}
+
+/* Profile */
+const char *const PHASE_NAMES[NUM_PHASES] = {
+  "parse", "execute", "descent", "leaf_insert", "split", "io_wait",
+};
+
+bool profile_enabled = false;
+uint64_t profile_phase_ns[NUM_PHASES];
+
+static Histogram histograms[PROFILE_STATEMENT_TYPES][NUM_PHASES];
+
+uint64_t profile_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void profile_begin_statement(void) {
+  memset(profile_phase_ns, 0, sizeof(profile_phase_ns));
+}
+
+void profile_end_statement(uint32_t statement_type, uint64_t parse_ns, uint64_t execute_ns) {
+  if (!profile_enabled || statement_type >= PROFILE_STATEMENT_TYPES) {
+    return;
+  }
+  profile_phase_ns[PHASE_PARSE] = parse_ns;
+  profile_phase_ns[PHASE_EXECUTE] = execute_ns;
+  for (Phase phase = 0; phase < NUM_PHASES; phase++) {
+    // Parse and execute are always recorded; the others only when the
+    // statement went through them, so their percentiles are not diluted.
+    if (phase <= PHASE_EXECUTE || profile_phase_ns[phase] > 0) {
+      histogram_record(&histograms[statement_type][phase], profile_phase_ns[phase]);
+    }
+  }
+}
+
+const Histogram *profile_histogram(uint32_t statement_type, Phase phase) {
+  return &histograms[statement_type][phase];
+}
+
+void profile_reset(void) {
+  memset(histograms, 0, sizeof(histograms));
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Log-linear latency histogram in the style of HdrHistogram. Values below
+ * 2^HISTOGRAM_SUB_BITS are counted exactly; larger ones in buckets that
+ * split each power of two into 2^HISTOGRAM_SUB_BITS, so a percentile is
+ * off by at most about 3%.
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_BUCKETS 1024 // covers 2^36 ns, longer values are clamped
+
+typedef struct {
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+void histogram_record(Histogram *h, uint64_t value);
+// Upper bound of the bucket holding the pct-th percentile.
+uint64_t histogram_percentile(const Histogram *h, double pct);
+
+/* Profile */
+typedef enum {
+  PHASE_PARSE,
+  PHASE_EXECUTE,
+  PHASE_DESCENT,     // root to leaf searches
+  PHASE_LEAF_INSERT, // inserts into a leaf with room
+  PHASE_SPLIT,       // inserts that split a leaf, with the splits above it
+  PHASE_IO_WAIT,     // file reads, writes and fsyncs, within the phases above
+  NUM_PHASES,
+} Phase;
+
+#define PROFILE_STATEMENT_TYPES 8
+
+extern const char *const PHASE_NAMES[NUM_PHASES];
+// Whether the running statement's session has .profile on.
+extern bool profile_enabled;
+// Time the current statement has spent in each phase.
+extern uint64_t profile_phase_ns[NUM_PHASES];
+
+uint64_t profile_now(void);
+
+static inline uint64_t phase_begin(void) {
+  return profile_enabled ? profile_now() : 0;
+}
+
+static inline void phase_end(Phase phase, uint64_t start) {
+  if (profile_enabled) {
+    profile_phase_ns[phase] += profile_now() - start;
+  }
+}
+
+void profile_begin_statement(void);
+// Adds the phases of the statement that just ran to the histograms of its
+// type. Does nothing unless profiling is on.
+void profile_end_statement(uint32_t statement_type, uint64_t parse_ns, uint64_t execute_ns);
+const Histogram *profile_histogram(uint32_t statement_type, Phase phase);
+void profile_reset(void);
@@ -1,49 +1,367 @@
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include "query.h"
 #include "storage.h"
 
-static PrepareResult prepare_insert(InputBuffer *b, Statement *stmt) {
-  stmt->type = STATEMENT_INSERT;
+/* Tokenizer */
+typedef enum {
+  TOKEN_END,
+  TOKEN_WORD,   // characters up to a space or punctuation
+  TOKEN_STRING, // quoted, text excludes the quotes
+  TOKEN_PUNCT,  // one of ( ) , = * ;
+  TOKEN_ERROR,  // unterminated string
+} TokenType;
 
-  strtok(b->buf, " "); // discard `insert`
-  char *id_string = strtok(NULL, " ");
-  char *username = strtok(NULL, " ");
-  char *email = strtok(NULL, " ");
+typedef struct {
+  TokenType type;
+  Slice text;
+} Token;
 
-  if (id_string == NULL || username == NULL || email == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+// Tokens are slices of the input; tok is the one not yet consumed.
+typedef struct {
+  const char *pos;
+  const char *tok_pos; // where tok starts, before any quote
+  Token tok;
+} Lexer;
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool is_punct(char c) {
+  return c != '\0' && strchr("(),=*;", c) != NULL;
+}
+
+static bool is_quote(char c) {
+  return c == '\'' || c == '"';
+}
+
+static void lex_string(Lexer *lx) {
+  char quote = *lx->pos++;
+  const char *start = lx->pos;
+  const char *close = strchr(start, quote);
+  if (close == NULL) {
+    lx->tok = (Token){TOKEN_ERROR, {start, 0}};
+    lx->pos = start + strlen(start);
+    return;
+  }
+  lx->tok = (Token){TOKEN_STRING, {start, close - start}};
+  lx->pos = close + 1;
+}
+
+static void lex_next(Lexer *lx) {
+  while (is_space(*lx->pos)) {
+    lx->pos++;
+  }
+  const char *start = lx->pos;
+  lx->tok_pos = start;
+  if (*start == '\0') {
+    lx->tok = (Token){TOKEN_END, {start, 0}};
+  } else if (is_quote(*start)) {
+    lex_string(lx);
+  } else if (is_punct(*start)) {
+    lx->tok = (Token){TOKEN_PUNCT, {start, 1}};
+    lx->pos++;
+  } else {
+    while (*lx->pos != '\0' && !is_space(*lx->pos) && !is_punct(*lx->pos)
+           && !is_quote(*lx->pos)) {
+      lx->pos++;
+    }
+    lx->tok = (Token){TOKEN_WORD, {start, lx->pos - start}};
+  }
+}
+
+// Like lex_next, but a word runs to the next space whatever it contains.
+static void lex_next_field(Lexer *lx) {
+  while (is_space(*lx->pos)) {
+    lx->pos++;
+  }
+  const char *start = lx->pos;
+  lx->tok_pos = start;
+  if (is_quote(*start)) {
+    lex_string(lx);
+    return;
+  }
+  while (*lx->pos != '\0' && !is_space(*lx->pos)) {
+    lx->pos++;
+  }
+  TokenType type = lx->pos == start ? TOKEN_END : TOKEN_WORD;
+  lx->tok = (Token){type, {start, lx->pos - start}};
+}
+
+static void lex_init(Lexer *lx, const char *input) {
+  lx->pos = input;
+  lex_next(lx);
+}
+
+/* Parser */
+static bool accept_keyword(Lexer *lx, const char *keyword) {
+  if (lx->tok.type != TOKEN_WORD
+      || lx->tok.text.len != strlen(keyword)
+      || strncasecmp(lx->tok.text.start, keyword, lx->tok.text.len) != 0) {
+    return false;
+  }
+  lex_next(lx);
+  return true;
+}
+
+static bool accept_punct(Lexer *lx, char c) {
+  if (lx->tok.type != TOKEN_PUNCT || *lx->tok.text.start != c) {
+    return false;
   }
+  lex_next(lx);
+  return true;
+}
 
-  char *endptr;
-  long id = strtol(id_string, &endptr, 10);
-  if (*endptr != '\0') {
+static bool at_end(Lexer *lx) {
+  accept_punct(lx, ';');
+  return lx->tok.type == TOKEN_END;
+}
+
+// The current token as an unsigned 32-bit number. Leaves the token in
+// place; the caller advances.
+static PrepareResult token_number(Lexer *lx, uint32_t *value) {
+  if (lx->tok.type != TOKEN_WORD) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  const char *p = lx->tok.text.start;
+  const char *end = p + lx->tok.text.len;
+  bool negative = *p == '-';
+  if (negative) {
+    p++;
+  }
+  if (p == end) {
     return PREPARE_SYNTAX_ERROR;
   }
-  if (id < 0) {
+  uint64_t n = 0;
+  for (; p < end; p++) {
+    if (*p < '0' || *p > '9') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    n = n * 10 + (*p - '0');
+    if (n > UINT32_MAX) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  if (negative && n > 0) {
     return PREPARE_NEGATIVE_ID;
   }
-  if (strlen(username) > COLUMN_USERNAME_SIZE) {
-    return PREPARE_STRING_TOO_LONG;
+  *value = n;
+  return PREPARE_SUCCESS;
+}
+
+static PrepareResult parse_number(Lexer *lx, uint32_t *value) {
+  PrepareResult result = token_number(lx, value);
+  if (result == PREPARE_SUCCESS) {
+    lex_next(lx);
   }
-  if (strlen(email) > COLUMN_EMAIL_SIZE) {
+  return result;
+}
+
+static bool parse_value(Lexer *lx, Slice *value) {
+  if (lx->tok.type != TOKEN_WORD && lx->tok.type != TOKEN_STRING) {
+    return false;
+  }
+  *value = lx->tok.text;
+  lex_next(lx);
+  return true;
+}
+
+static PrepareResult copy_column(Slice value, char *dest, uint32_t max_len) {
+  if (value.len > max_len) {
     return PREPARE_STRING_TOO_LONG;
   }
+  memcpy(dest, value.start, value.len);
+  dest[value.len] = '\0';
+  return PREPARE_SUCCESS;
+}
 
-  stmt->row_to_insert.id = (uint32_t)id;
-  strcpy(stmt->row_to_insert.username, username);
-  strcpy(stmt->row_to_insert.email, email);
+static PrepareResult fill_row(Row *row, Slice username, Slice email) {
+  PrepareResult result = copy_column(username, row->username, COLUMN_USERNAME_SIZE);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  return copy_column(email, row->email, COLUMN_EMAIL_SIZE);
+}
 
-  return PREPARE_SUCCESS;
+// insert id word word
+static PrepareResult parse_insert_fields(Lexer *lx, Statement *stmt) {
+  // Rewind to the id and read the fields with lex_next_field.
+  lx->pos = lx->tok_pos;
+  Slice fields[3];
+  for (int i = 0; i < 3; i++) {
+    lex_next_field(lx);
+    if (lx->tok.type != TOKEN_WORD && lx->tok.type != TOKEN_STRING) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (i == 0) {
+      PrepareResult result = token_number(lx, &stmt->row_to_insert.id);
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+    }
+    fields[i] = lx->tok.text;
+  }
+  lex_next_field(lx);
+  if (lx->tok.type != TOKEN_END) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  stmt->num_rows = 1;
+  stmt->next_row = NULL;
+  return fill_row(&stmt->row_to_insert, fields[1], fields[2]);
+}
+
+// "(" id "," value "," value ")"
+static PrepareResult parse_tuple(Lexer *lx, Row *row) {
+  Slice username, email;
+  if (!accept_punct(lx, '(')) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  PrepareResult result = parse_number(lx, &row->id);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  if (!accept_punct(lx, ',') || !parse_value(lx, &username)
+      || !accept_punct(lx, ',') || !parse_value(lx, &email)
+      || !accept_punct(lx, ')')) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  return fill_row(row, username, email);
+}
+
+static PrepareResult parse_insert(Lexer *lx, Statement *stmt) {
+  stmt->type = STATEMENT_INSERT;
+  bool into = accept_keyword(lx, "into");
+  if (into && !accept_keyword(lx, "users")) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (!accept_keyword(lx, "values")) {
+    return into ? PREPARE_SYNTAX_ERROR : parse_insert_fields(lx, stmt);
+  }
+
+  // Check every tuple now; only the first is kept; statement_next_row
+  // decodes the others again when they are inserted.
+  PrepareResult result = parse_tuple(lx, &stmt->row_to_insert);
+  stmt->num_rows = 1;
+  stmt->next_row = NULL;
+  while (result == PREPARE_SUCCESS && accept_punct(lx, ',')) {
+    if (stmt->next_row == NULL) {
+      stmt->next_row = lx->tok.text.start;
+    }
+    Row row;
+    result = parse_tuple(lx, &row);
+    stmt->num_rows++;
+  }
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  return at_end(lx) ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+// Only patterns without wildcards, or with a single trailing "%", are
+// supported. The "%" is dropped from the value.
+static bool parse_prefix_pattern(Slice *value, bool *prefix) {
+  *prefix = value->len > 0 && value->start[value->len - 1] == '%';
+  if (*prefix) {
+    value->len--;
+  }
+  for (uint32_t i = 0; i < value->len; i++) {
+    if (value->start[i] == '%' || value->start[i] == '_') {
+      return false;
+    }
+  }
+  return true;
+}
+
+static PrepareResult parse_select(Lexer *lx, Statement *stmt) {
+  stmt->type = STATEMENT_SELECT;
+  stmt->filter = FILTER_NONE;
+  stmt->filter_prefix = false;
+  stmt->has_order = false;
+  stmt->has_limit = false;
+  accept_punct(lx, '*');
+
+  if (accept_keyword(lx, "where")) {
+    if (accept_keyword(lx, "id")) {
+      stmt->filter = FILTER_ID;
+    } else if (accept_keyword(lx, "username")) {
+      stmt->filter = FILTER_USERNAME;
+    } else if (accept_keyword(lx, "email")) {
+      stmt->filter = FILTER_EMAIL;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (stmt->filter != FILTER_ID && accept_keyword(lx, "like")) {
+      if (!parse_value(lx, &stmt->filter_value)
+          || !parse_prefix_pattern(&stmt->filter_value, &stmt->filter_prefix)) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+    } else if (!accept_punct(lx, '=')) {
+      return PREPARE_SYNTAX_ERROR;
+    } else if (stmt->filter == FILTER_ID) {
+      PrepareResult result = parse_number(lx, &stmt->filter_id);
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+    } else if (!parse_value(lx, &stmt->filter_value)) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+
+  if (accept_keyword(lx, "order")) {
+    if (!accept_keyword(lx, "by")) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    if (accept_keyword(lx, "username")) {
+      stmt->has_order = true;
+      stmt->order_by = COLUMN_USERNAME;
+    } else if (accept_keyword(lx, "email")) {
+      stmt->has_order = true;
+      stmt->order_by = COLUMN_EMAIL;
+    } else if (!accept_keyword(lx, "id")) { // the scan order already
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+
+  if (accept_keyword(lx, "limit")) {
+    if (parse_number(lx, &stmt->limit) != PREPARE_SUCCESS) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    stmt->has_limit = true;
+  }
+  return at_end(lx) ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
 }
 
 PrepareResult prepare_statement(InputBuffer *b, Statement *stmt) {
-  if (strncmp(b->buf, "insert", 6) == 0) {
-    return prepare_insert(b, stmt);
+  Lexer lx;
+  lex_init(&lx, b->buf);
+
+  if (accept_keyword(&lx, "insert")) {
+    return parse_insert(&lx, stmt);
+  }
+  if (accept_keyword(&lx, "select")) {
+    return parse_select(&lx, stmt);
+  }
+  if (accept_keyword(&lx, "begin")) {
+    stmt->type = STATEMENT_BEGIN;
+  } else if (accept_keyword(&lx, "commit")) {
+    stmt->type = STATEMENT_COMMIT;
+  } else if (accept_keyword(&lx, "rollback")) {
+    stmt->type = STATEMENT_ROLLBACK;
+  } else {
+    return PREPARE_UNRECOGNIZED_STATEMENT;
   }
-  if (strncmp(b->buf, "select", 6) == 0) {
-    stmt->type = STATEMENT_SELECT;
-    return PREPARE_SUCCESS;
+  return at_end(&lx) ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+bool statement_next_row(Statement *stmt) {
+  if (stmt->next_row == NULL) {
+    return false;
   }
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+  Lexer lx;
+  lex_init(&lx, stmt->next_row);
+  parse_tuple(&lx, &stmt->row_to_insert);
+  stmt->next_row = accept_punct(&lx, ',') ? lx.tok.text.start : NULL;
+  return true;
 }
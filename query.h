@@ -6,11 +6,45 @@
 typedef enum {
   STATEMENT_INSERT,
   STATEMENT_SELECT,
+  STATEMENT_BEGIN,
+  STATEMENT_COMMIT,
+  STATEMENT_ROLLBACK,
 } StatementType;
 
+// A piece of the input buffer. Not NUL terminated.
+typedef struct {
+  const char *start;
+  uint32_t len;
+} Slice;
+
+typedef enum {
+  FILTER_NONE,
+  FILTER_ID,
+  FILTER_USERNAME,
+  FILTER_EMAIL,
+} FilterColumn;
+
+/*
+ * A prepared statement refers to the input buffer it was parsed from, which
+ * must not change until the statement has been executed.
+ */
 typedef struct {
   StatementType type;
-  Row row_to_insert; // only used in insert statement
+
+  /* insert */
+  uint32_t num_rows;
+  Row row_to_insert;    // the current row, see statement_next_row
+  const char *next_row; // the tuple after it, NULL for the last row
+
+  /* select: WHERE column = value ORDER BY column LIMIT n */
+  FilterColumn filter;
+  uint32_t filter_id;  // FILTER_ID
+  Slice filter_value;  // FILTER_USERNAME and FILTER_EMAIL
+  bool filter_prefix;  // LIKE 'value%'
+  bool has_order;      // false for id order
+  Column order_by;
+  bool has_limit;
+  uint32_t limit;
 } Statement;
 
 typedef enum {
@@ -21,4 +55,25 @@ typedef enum {
   PREPARE_NEGATIVE_ID,
 } PrepareResult;
 
+/*
+ * statement := insert | select | "begin" | "commit" | "rollback"
+ * insert    := "insert" id word word
+ *            | "insert" ["into" "users"] "values" tuple ("," tuple)*
+ * tuple     := "(" id "," value "," value ")"
+ * select    := "select" ["*"] ["where" condition] ["order" "by" column]
+ *              ["limit" number]
+ * condition := column "=" value | ("username" | "email") "like" value
+ * column    := "id" | "username" | "email"
+ * value     := word | 'quoted' | "quoted"
+ *
+ * Keywords are case insensitive. A quoted string cannot contain its own
+ * quote character. A like pattern may only end in "%"; "_" and other "%"
+ * are rejected. The words of the first form of insert end only at
+ * spaces. A trailing ";" is allowed. Parsing allocates nothing and does
+ * not modify the input.
+ */
 PrepareResult prepare_statement(InputBuffer *b, Statement *stmt);
+
+// Moves row_to_insert to the next row of a multi-row insert, or returns
+// false if it is the last. The rows were checked by prepare_statement.
+bool statement_next_row(Statement *stmt);
@@ -0,0 +1,409 @@
+#define _GNU_SOURCE // accept4
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "engine.h"
+#include "server.h"
+#include "util.h"
+
+#define MAX_EVENTS 64
+#define READ_SIZE 65536
+// A client's commands stop running while this much output is unsent, and
+// resume once it has drained.
+#define OUTPUT_HIGH_WATER (1 << 20)
+
+/*
+ * One process owns the table and serves every client from a single
+ * thread, so statements never run concurrently. Clients may pipeline:
+ * each readable event reads once, runs every complete line received, and
+ * sends the outputs of all of them with one write.
+ *
+ * Only one session can have a transaction open. While it does, the other
+ * sessions still run selects against their snapshots, but their first
+ * statement that writes (or begins, commits or rolls back) is held, along
+ * with everything after it, until the transaction ends.
+ *
+ * A select that walks the table runs a leaf per turn of the event loop,
+ * so a long scan does not hold up the other clients. It reads its
+ * snapshot, so their writes in the meantime do not show up in it. An
+ * ordered one then prints its rows a leaf's worth per turn, so its output
+ * is held back while the client is slow to read it, as for any other.
+ */
+typedef struct Client_tag {
+  int fd;
+  Session session;
+  char *in; // received, not yet run
+  size_t in_len;
+  size_t in_cap;
+  char *out; // output, not yet sent
+  size_t out_len;
+  size_t out_cap;
+  size_t out_sent;
+  uint32_t events; // registered with epoll
+  bool blocked;    // waiting for another session's transaction to end
+  bool eof;        // the client is done sending, or sent .exit
+  bool closed;     // freed once the current batch of events is handled
+  struct Client_tag *next;
+} Client;
+
+typedef struct {
+  Table *table;
+  int epfd;
+  int listen_fd;
+  Client *clients;
+  Client *closed;
+  InputBuffer line; // the line being run, NUL terminated
+} Server;
+
+static void *grow(void *buf, size_t *cap, size_t needed) {
+  if (needed <= *cap) {
+    return buf;
+  }
+  size_t new_cap = *cap ? *cap : 4096;
+  while (new_cap < needed) {
+    new_cap *= 2;
+  }
+  buf = realloc(buf, new_cap);
+  if (!buf) die("realloc");
+  *cap = new_cap;
+  return buf;
+}
+
+static size_t unsent(Client *c) {
+  return c->out_len - c->out_sent;
+}
+
+// Whether the client has a select to go on with, and room for its output.
+static bool client_scanning(Client *c) {
+  return c->session.scan && unsent(c) < OUTPUT_HIGH_WATER;
+}
+
+// Read while there is room for output and nothing is held or running;
+// write while output is pending.
+static void client_update_events(Server *srv, Client *c) {
+  uint32_t events = 0;
+  if (!c->eof && !c->blocked && !c->session.scan && unsent(c) < OUTPUT_HIGH_WATER) {
+    events |= EPOLLIN;
+  }
+  if (unsent(c) > 0) {
+    events |= EPOLLOUT;
+  }
+  if (events == c->events) {
+    return;
+  }
+  struct epoll_event ev = {.events = events, .data.ptr = c};
+  if (epoll_ctl(srv->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1) die("epoll_ctl");
+  c->events = events;
+}
+
+// Ends the session, rolling back its transaction. Other events for the
+// client may still be pending, so it is only freed by free_closed.
+static void client_close(Server *srv, Client *c) {
+  session_end(&c->session);
+  for (Client **link = &srv->clients; *link; link = &(*link)->next) {
+    if (*link == c) {
+      *link = c->next;
+      break;
+    }
+  }
+  epoll_ctl(srv->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->closed = true;
+  c->next = srv->closed;
+  srv->closed = c;
+}
+
+static void free_closed(Server *srv) {
+  while (srv->closed) {
+    Client *c = srv->closed;
+    srv->closed = c->next;
+    free(c->in);
+    free(c->out);
+    free(c);
+  }
+}
+
+// Runs the stopped select over a leaf, then the complete lines the client
+// has sent, until one is held or stops, or the output backs up. At end of
+// input, a last line without a newline runs too.
+static void client_run(Server *srv, Client *c) {
+  char *batch = NULL;
+  size_t batch_len = 0;
+  FILE *out = open_memstream(&batch, &batch_len);
+  if (!out) die("open_memstream");
+
+  if (client_scanning(c) && resume_command(&c->session, out) == COMMAND_DONE) {
+    fputc('\n', out);
+    fflush(out);
+  }
+
+  size_t consumed = 0;
+  while (consumed < c->in_len && !c->blocked && !c->session.scan
+         && unsent(c) + batch_len < OUTPUT_HIGH_WATER) {
+    char *start = c->in + consumed;
+    size_t remaining = c->in_len - consumed;
+    char *newline = memchr(start, '\n', remaining);
+    if (!newline && !c->eof) {
+      break;
+    }
+    size_t line_end = newline ? (size_t)(newline - start) + 1 : remaining;
+    size_t len = newline ? line_end - 1 : remaining;
+    if (len > 0 && start[len - 1] == '\r') {
+      len--;
+    }
+
+    srv->line.buf = grow(srv->line.buf, &srv->line.buf_len, len + 1);
+    memcpy(srv->line.buf, start, len);
+    srv->line.buf[len] = '\0';
+    srv->line.input_len = len;
+
+    CommandResult result = run_command(&srv->line, &c->session, out);
+    if (result == COMMAND_BLOCKED) {
+      c->blocked = true;
+      break;
+    }
+    consumed += line_end;
+    if (result == COMMAND_EXIT) {
+      c->eof = true;
+      consumed = c->in_len;
+      break;
+    }
+    if (result == COMMAND_PAUSED) {
+      break;
+    }
+    fputc('\n', out);
+    fflush(out);
+  }
+
+  memmove(c->in, c->in + consumed, c->in_len - consumed);
+  c->in_len -= consumed;
+
+  if (fclose(out) != 0) die("fclose");
+  if (batch_len > 0) {
+    if (c->out_sent > 0) {
+      memmove(c->out, c->out + c->out_sent, unsent(c));
+      c->out_len -= c->out_sent;
+      c->out_sent = 0;
+    }
+    c->out = grow(c->out, &c->out_cap, c->out_len + batch_len);
+    memcpy(c->out + c->out_len, batch, batch_len);
+    c->out_len += batch_len;
+  }
+  free(batch);
+}
+
+// Sends what the socket takes. Returns false when the client is finished
+// or gone and should be closed.
+static bool client_flush(Server *srv, Client *c) {
+  while (unsent(c) > 0) {
+    ssize_t n = send(c->fd, c->out + c->out_sent, unsent(c), MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return false; // the client went away
+    }
+    c->out_sent += n;
+  }
+  if (unsent(c) == 0) {
+    c->out_len = c->out_sent = 0;
+    if (c->eof && !c->blocked && !c->session.scan && c->in_len == 0) {
+      return false;
+    }
+  }
+  client_update_events(srv, c);
+  return true;
+}
+
+static void client_step(Server *srv, Client *c) {
+  client_run(srv, c);
+  if (!client_flush(srv, c)) {
+    client_close(srv, c);
+  }
+}
+
+// Once no transaction is open, let held sessions run again. One of them
+// may begin a new transaction, which holds the rest once more.
+static void resume_blocked(Server *srv) {
+  bool resumed = true;
+  while (resumed && !db_in_transaction(srv->table)) {
+    resumed = false;
+    for (Client *c = srv->clients; c; c = c->next) {
+      if (c->blocked) {
+        c->blocked = false;
+        client_step(srv, c);
+        resumed = true;
+        break;
+      }
+    }
+  }
+}
+
+// Takes every stopped select whose output has room one leaf further.
+static void run_scans(Server *srv) {
+  Client *c = srv->clients;
+  while (c) {
+    Client *next = c->next;
+    if (client_scanning(c)) {
+      client_step(srv, c);
+    }
+    c = next;
+  }
+}
+
+static bool any_scanning(Server *srv) {
+  for (Client *c = srv->clients; c; c = c->next) {
+    if (client_scanning(c)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void accept_clients(Server *srv) {
+  for (;;) {
+    int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      die("accept4");
+    }
+
+    Client *c = calloc(1, sizeof(Client));
+    if (!c) die("calloc");
+    c->fd = fd;
+    session_init(&c->session, srv->table);
+    c->session.pause_scans = true;
+    c->events = EPOLLIN;
+    struct epoll_event ev = {.events = c->events, .data.ptr = c};
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) die("epoll_ctl");
+    c->next = srv->clients;
+    srv->clients = c;
+  }
+}
+
+static void client_read(Server *srv, Client *c) {
+  c->in = grow(c->in, &c->in_cap, c->in_len + READ_SIZE);
+  ssize_t n = recv(c->fd, c->in + c->in_len, READ_SIZE, 0);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return;
+    }
+    client_close(srv, c);
+    return;
+  }
+  if (n == 0) {
+    c->eof = true;
+  }
+  c->in_len += n;
+  client_step(srv, c);
+}
+
+static int listen_on(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path is too long.\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, path);
+
+  // Replace a socket left behind by a server that did not shut down.
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) die("socket");
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) die("bind");
+  if (listen(fd, SOMAXCONN) == -1) die("listen");
+  return fd;
+}
+
+static void on_signal(int sig) {
+  // Only interrupts epoll_pwait.
+}
+
+void serve(Table *table, const char *path) {
+  // SIGINT and SIGTERM are only delivered while waiting for events, so a
+  // statement is never interrupted.
+  sigset_t stop_signals, wait_mask;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  if (sigprocmask(SIG_BLOCK, &stop_signals, &wait_mask) == -1) die("sigprocmask");
+  sigdelset(&wait_mask, SIGINT);
+  sigdelset(&wait_mask, SIGTERM);
+  struct sigaction sa = {.sa_handler = on_signal};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  Server srv = {.table = table, .clients = NULL};
+  srv.listen_fd = listen_on(path);
+  srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (srv.epfd == -1) die("epoll_create1");
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.listen_fd, &ev) == -1) die("epoll_ctl");
+
+  struct epoll_event events[MAX_EVENTS];
+  for (;;) {
+    // Don't wait while selects can go on.
+    int timeout = any_scanning(&srv) ? 0 : -1;
+    int n = epoll_pwait(srv.epfd, events, MAX_EVENTS, timeout, &wait_mask);
+    if (n == -1) {
+      if (errno == EINTR) {
+        break; // SIGINT or SIGTERM
+      }
+      die("epoll_pwait");
+    }
+
+    for (int i = 0; i < n; i++) {
+      Client *c = events[i].data.ptr;
+      if (c == NULL) {
+        accept_clients(&srv);
+        continue;
+      }
+      if (c->closed) {
+        continue;
+      }
+      if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+        client_close(&srv, c);
+      } else if (events[i].events & EPOLLIN) {
+        client_read(&srv, c);
+      } else if (events[i].events & EPOLLOUT) {
+        if (!client_flush(&srv, c)) {
+          client_close(&srv, c);
+        } else if (unsent(c) == 0) {
+          client_step(&srv, c); // run what was held back by the output
+        }
+      }
+      resume_blocked(&srv);
+    }
+    run_scans(&srv);
+    resume_blocked(&srv);
+    free_closed(&srv);
+  }
+
+  while (srv.clients) {
+    client_close(&srv, srv.clients);
+  }
+  free_closed(&srv);
+  close(srv.epfd);
+  close(srv.listen_fd);
+  unlink(path);
+  free(srv.line.buf);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "storage.h"
+
+// Serves the table to clients of a Unix domain socket at path until
+// SIGINT or SIGTERM. Each line a client sends is run as in the REPL; the
+// output of each is followed by an empty line.
+void serve(Table *table, const char *path);
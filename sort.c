@@ -0,0 +1,296 @@
+#define _GNU_SOURCE // qsort_r
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sort.h"
+#include "util.h"
+
+// Runs merged at once; more are merged in several passes.
+#define SORT_MAX_FAN_IN 64
+
+// A run being merged. row must stay first: the merge heap holds pointers
+// to it.
+typedef struct {
+  Row row;
+  FILE *file;
+} RunHead;
+
+struct Sorter_tag {
+  size_t key_offset; // of the column in a Row
+  uint32_t limit;
+  bool top_n;
+  Row *rows;
+  Row **order; // the heap in top_n mode, filled before sorting otherwise
+  uint32_t num_rows;
+  uint32_t allocated;
+  uint32_t capacity; // rows held before spilling, or limit in top_n mode
+  FILE **runs;
+  uint32_t num_runs;
+  // The final merge, once finished, unless everything fit in memory.
+  RunHead *heads;
+  Row **heap;
+  uint32_t live; // runs with rows left
+  uint32_t returned;
+};
+
+static int compare_rows(const Row *a, const Row *b, const Sorter *s) {
+  int c = strcmp((const char *)a + s->key_offset, (const char *)b + s->key_offset);
+  if (c != 0) {
+    return c;
+  }
+  return (a->id > b->id) - (a->id < b->id);
+}
+
+static int compare_row_ptrs(const void *a, const void *b, void *s) {
+  return compare_rows(*(Row *const *)a, *(Row *const *)b, s);
+}
+
+// Restores the heap below i. sign 1 keeps the greatest row on top, -1 the
+// least.
+static void sift_down(const Sorter *s, Row **heap, uint32_t n, uint32_t i, int sign) {
+  for (;;) {
+    uint32_t top = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+    if (left < n && sign * compare_rows(heap[left], heap[top], s) > 0) {
+      top = left;
+    }
+    if (right < n && sign * compare_rows(heap[right], heap[top], s) > 0) {
+      top = right;
+    }
+    if (top == i) {
+      return;
+    }
+    Row *tmp = heap[i];
+    heap[i] = heap[top];
+    heap[top] = tmp;
+    i = top;
+  }
+}
+
+static void sift_up(const Sorter *s, Row **heap, uint32_t i, int sign) {
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (sign * compare_rows(heap[i], heap[parent], s) <= 0) {
+      return;
+    }
+    Row *tmp = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = tmp;
+    i = parent;
+  }
+}
+
+static FILE *temp_file(void) {
+  const char *dir = getenv("TMPDIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/rdb-sort-XXXXXX", dir && *dir ? dir : "/tmp");
+  int fd = mkstemp(path);
+  if (fd == -1) die("mkstemp");
+  unlink(path); // removed when closed, even if the process dies
+  FILE *f = fdopen(fd, "w+");
+  if (!f) die("fdopen");
+  return f;
+}
+
+Sorter *sorter_new(Column column, uint32_t limit, size_t memory) {
+  Sorter *s = calloc(1, sizeof(Sorter));
+  if (!s) die("calloc");
+  s->key_offset = column == COLUMN_USERNAME ? offsetof(Row, username) : offsetof(Row, email);
+  s->limit = limit;
+  size_t capacity = memory / (sizeof(Row) + sizeof(Row *));
+  if (capacity < 2) {
+    capacity = 2;
+  }
+  s->top_n = limit <= capacity;
+  s->capacity = s->top_n ? limit : capacity > UINT32_MAX ? UINT32_MAX : capacity;
+  return s;
+}
+
+// Grows the arrays toward capacity as rows arrive, so a small result does
+// not allocate the whole budget.
+static void sorter_grow(Sorter *s) {
+  uint32_t allocated = s->allocated ? s->allocated * 2 : 256;
+  if (allocated > s->capacity || allocated < s->allocated) {
+    allocated = s->capacity;
+  }
+  Row *rows = realloc(s->rows, (size_t)allocated * sizeof(Row));
+  if (!rows) die("realloc");
+  s->order = realloc(s->order, (size_t)allocated * sizeof(Row *));
+  if (!s->order) die("realloc");
+  for (uint32_t i = 0; i < s->num_rows; i++) {
+    s->order[i] = rows + (s->order[i] - s->rows);
+  }
+  s->rows = rows;
+  s->allocated = allocated;
+}
+
+static void sort_rows(Sorter *s) {
+  for (uint32_t i = 0; i < s->num_rows; i++) {
+    s->order[i] = &s->rows[i];
+  }
+  qsort_r(s->order, s->num_rows, sizeof(Row *), compare_row_ptrs, s);
+}
+
+static void spill(Sorter *s) {
+  sort_rows(s);
+  FILE *run = temp_file();
+  for (uint32_t i = 0; i < s->num_rows; i++) {
+    if (fwrite(s->order[i], sizeof(Row), 1, run) != 1) die("fwrite");
+  }
+  if (fflush(run) != 0) die("fflush");
+  rewind(run);
+  s->runs = realloc(s->runs, (s->num_runs + 1) * sizeof(FILE *));
+  if (!s->runs) die("realloc");
+  s->runs[s->num_runs++] = run;
+  s->num_rows = 0;
+}
+
+void sorter_add(Sorter *s, Row *row) {
+  if (s->top_n) {
+    if (s->limit == 0) {
+      return;
+    }
+    if (s->num_rows == s->limit) {
+      // Full: the row replaces the greatest kept one if it is less.
+      Row *greatest = s->order[0];
+      if (compare_rows(row, greatest, s) < 0) {
+        *greatest = *row;
+        sift_down(s, s->order, s->num_rows, 0, 1);
+      }
+      return;
+    }
+    if (s->num_rows == s->allocated) {
+      sorter_grow(s);
+    }
+    s->rows[s->num_rows] = *row;
+    s->order[s->num_rows] = &s->rows[s->num_rows];
+    sift_up(s, s->order, s->num_rows, 1);
+    s->num_rows++;
+    return;
+  }
+
+  if (s->num_rows == s->capacity) {
+    spill(s);
+  } else if (s->num_rows == s->allocated) {
+    sorter_grow(s);
+  }
+  s->rows[s->num_rows++] = *row;
+}
+
+static bool read_row(FILE *run, Row *row) {
+  if (fread(row, sizeof(Row), 1, run) == 1) {
+    return true;
+  }
+  if (ferror(run)) die("fread");
+  return false;
+}
+
+// Reads the first row of each run into heads, and builds a heap of them
+// with the least on top. Returns how many runs have rows.
+static uint32_t merge_start(const Sorter *s, FILE **runs, uint32_t n, RunHead *heads, Row **heap) {
+  uint32_t live = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    heads[i].file = runs[i];
+    if (read_row(runs[i], &heads[i].row)) {
+      heap[live] = &heads[i].row;
+      sift_up(s, heap, live++, -1);
+    }
+  }
+  return live;
+}
+
+// Takes the least row off the heap, and the next row of its run in its
+// place.
+static void merge_pop(const Sorter *s, Row **heap, uint32_t *live, Row *row) {
+  RunHead *head = (RunHead *)heap[0];
+  *row = head->row;
+  if (!read_row(head->file, &head->row)) {
+    heap[0] = heap[--*live];
+  }
+  sift_down(s, heap, *live, 0, -1);
+}
+
+// Merges runs into dest and closes them.
+static void merge(Sorter *s, FILE **runs, uint32_t n, FILE *dest) {
+  RunHead *heads = malloc(n * sizeof(RunHead));
+  Row **heap = malloc(n * sizeof(Row *));
+  if (!heads || !heap) die("malloc");
+  uint32_t live = merge_start(s, runs, n, heads, heap);
+  Row row;
+  while (live > 0) {
+    merge_pop(s, heap, &live, &row);
+    if (fwrite(&row, sizeof(Row), 1, dest) != 1) die("fwrite");
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    fclose(runs[i]);
+  }
+  free(heads);
+  free(heap);
+}
+
+void sorter_finish(Sorter *s) {
+  if (s->num_runs == 0) {
+    // Everything fit in memory.
+    sort_rows(s);
+    return;
+  }
+
+  if (s->num_rows > 0) {
+    spill(s);
+  }
+  free(s->rows);
+  free(s->order);
+  s->rows = NULL;
+  s->order = NULL;
+  while (s->num_runs > SORT_MAX_FAN_IN) {
+    uint32_t merged = 0;
+    for (uint32_t i = 0; i < s->num_runs; i += SORT_MAX_FAN_IN) {
+      uint32_t n = s->num_runs - i < SORT_MAX_FAN_IN ? s->num_runs - i : SORT_MAX_FAN_IN;
+      FILE *run = temp_file();
+      merge(s, s->runs + i, n, run);
+      if (fflush(run) != 0) die("fflush");
+      rewind(run);
+      s->runs[merged++] = run;
+    }
+    s->num_runs = merged;
+  }
+  // The last merge runs as the rows are asked for.
+  s->heads = malloc(s->num_runs * sizeof(RunHead));
+  s->heap = malloc(s->num_runs * sizeof(Row *));
+  if (!s->heads || !s->heap) die("malloc");
+  s->live = merge_start(s, s->runs, s->num_runs, s->heads, s->heap);
+}
+
+bool sorter_next(Sorter *s, Row *row) {
+  if (s->returned == s->limit) {
+    return false;
+  }
+  if (s->heap) {
+    if (s->live == 0) {
+      return false;
+    }
+    merge_pop(s, s->heap, &s->live, row);
+  } else {
+    if (s->returned == s->num_rows) {
+      return false;
+    }
+    *row = *s->order[s->returned];
+  }
+  s->returned++;
+  return true;
+}
+
+void sorter_free(Sorter *s) {
+  for (uint32_t i = 0; i < s->num_runs; i++) {
+    fclose(s->runs[i]);
+  }
+  free(s->rows);
+  free(s->order);
+  free(s->runs);
+  free(s->heads);
+  free(s->heap);
+  free(s);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdio.h>
+#include "storage.h"
+
+// Default bytes of rows a sort holds in memory before it spills a sorted
+// run to a temporary file in $TMPDIR, or /tmp.
+#define SORT_MEMORY_DEFAULT ((size_t)64 << 20)
+
+/*
+ * Sorts rows by a text column, ties by id. With a limit that fits in
+ * memory, only the first limit rows are kept, in a heap. Otherwise
+ * rows are spilled in sorted runs, which are merged at the end.
+ */
+typedef struct Sorter_tag Sorter;
+
+// limit is UINT32_MAX when there is none.
+Sorter *sorter_new(Column column, uint32_t limit, size_t memory);
+void sorter_add(Sorter *s, Row *row);
+// Ends the input. Rows are then read in order with sorter_next.
+void sorter_finish(Sorter *s);
+// Sets row to the next in order. Returns false after the last, or the
+// limit-th.
+bool sorter_next(Sorter *s, Row *row);
+void sorter_free(Sorter *s);
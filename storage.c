@@ -1,9 +1,16 @@
+#define _GNU_SOURCE // copy_file_range
 #include <assert.h>
+#include <errno.h>
+#include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/sendfile.h>
+#include "lz.h"
+#include "match.h"
+#include "profile.h"
 #include "storage.h"
 #include "util.h"
 
@@ -19,14 +26,15 @@ static const uint32_t ID_OFFSET = 0;
 static const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
 static const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 
-void print_row(Row *row) {
-  printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+void print_row(FILE *out, Row *row) {
+  fprintf(out, "(%d, %s, %s)\n", row->id, row->username, row->email);
 }
 
 void serialize_row(Row *src, void *dest) {
   memcpy(dest + ID_OFFSET, &(src->id), ID_SIZE);
-  memcpy(dest + USERNAME_OFFSET, &(src->username), USERNAME_SIZE);
-  memcpy(dest + EMAIL_OFFSET, &(src->email), EMAIL_SIZE);
+  // strncpy zero-fills the rest of the column, which keeps pages compressible
+  strncpy(dest + USERNAME_OFFSET, src->username, USERNAME_SIZE);
+  strncpy(dest + EMAIL_OFFSET, src->email, EMAIL_SIZE);
 }
 
 void deserialize_row(void *src, Row *dest) {
@@ -36,7 +44,7 @@ void deserialize_row(void *src, Row *dest) {
 }
 
 /* B-Tree */
-#define TABLE_MAX_PAGES 100
+#define PAGER_MAX_CACHED_PAGES 100
 static const uint32_t PAGE_SIZE = 4096;
 #define INVALID_PAGE_NUM UINT32_MAX
 
@@ -45,22 +53,52 @@ typedef enum {
   NODE_LEAF,
 } NodeType;
 
-/* Common Node Header Layout */
-static const uint32_t NODE_TYPE_SIZE = sizeof(NodeType);
+/*
+ * Common Node Header Layout. Every field has a fixed width and is stored
+ * little-endian, so a file does not depend on the compiler's enum and
+ * pointer sizes, and the parent pointer is 4-byte aligned.
+ */
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+               "pages are accessed in place as little-endian");
+#define NODE_FORMAT_VERSION 1
+static const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
 static const uint32_t NODE_TYPE_OFFSET = 0;
-static const uint32_t IS_ROOT_SIZE = sizeof(bool);
+static const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 static const uint32_t IS_ROOT_OFFSET = NODE_TYPE_OFFSET + NODE_TYPE_SIZE;
-static const uint32_t PARENT_POINTER_SIZE = sizeof(uintptr_t);
-static const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+static const uint32_t NODE_VERSION_SIZE = sizeof(uint8_t);
+static const uint32_t NODE_VERSION_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+static const uint32_t NODE_RESERVED_SIZE = sizeof(uint8_t);
+static const uint32_t NODE_RESERVED_OFFSET = NODE_VERSION_OFFSET + NODE_VERSION_SIZE;
+static const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
+static const uint32_t PARENT_POINTER_OFFSET = NODE_RESERVED_OFFSET + NODE_RESERVED_SIZE;
 static const uint32_t COMMON_NODE_HEADER_SIZE =
-  NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+  NODE_TYPE_SIZE + IS_ROOT_SIZE + NODE_VERSION_SIZE + NODE_RESERVED_SIZE
+  + PARENT_POINTER_SIZE;
+
+/*
+ * Before NODE_FORMAT_VERSION the header was a 4-byte NodeType, a bool and
+ * an 8-byte parent pointer of which only the first 4 bytes were used. Byte
+ * 2, now the version, was inside the type and always 0.
+ */
+static const uint32_t LEGACY_IS_ROOT_OFFSET = 4;
+static const uint32_t LEGACY_PARENT_POINTER_OFFSET = 5;
+static const uint32_t LEGACY_NODE_HEADER_SIZE = 13;
 
 static bool is_root_node(void *node) {
-  return *(bool *)(node + IS_ROOT_OFFSET);
+  return *(uint8_t *)(node + IS_ROOT_OFFSET) != 0;
 }
 
 static void set_node_root(void *node, bool is_root) {
-  *(bool *)(node + IS_ROOT_OFFSET) = is_root;
+  *(uint8_t *)(node + IS_ROOT_OFFSET) = is_root;
+}
+
+static uint8_t node_version(void *node) {
+  return *(uint8_t *)(node + NODE_VERSION_OFFSET);
+}
+
+static void set_node_version(void *node) {
+  *(uint8_t *)(node + NODE_VERSION_OFFSET) = NODE_FORMAT_VERSION;
+  *(uint8_t *)(node + NODE_RESERVED_OFFSET) = 0;
 }
 
 static uint32_t *node_parent(void *node) {
@@ -91,11 +129,11 @@ static const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) /
 static const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
 
 static NodeType get_node_type(void *node) {
-  return *(NodeType *)(node + NODE_TYPE_OFFSET);
+  return *(uint8_t *)(node + NODE_TYPE_OFFSET);
 }
 
 static void set_node_type(void *node, NodeType type) {
-  *(NodeType *)(node + NODE_TYPE_OFFSET) = type;
+  *(uint8_t *)(node + NODE_TYPE_OFFSET) = type;
 }
 
 // TODO: to private
@@ -125,6 +163,7 @@ static void initialize_leaf_node(void *node) {
   *leaf_node_next_leaf(node) = 0; // 0 denotes no sibling
   set_node_type(node, NODE_LEAF);
   set_node_root(node, false);
+  set_node_version(node);
 }
 
 /* Internal Node Header Layout */
@@ -190,10 +229,33 @@ static uint32_t *internal_node_key(void *node, uint32_t key_num) {
 static void initialize_internal_node(void *node) {
   set_node_type(node, NODE_INTERNAL);
   set_node_root(node, false);
+  set_node_version(node);
   *internal_node_num_keys(node) = 0;
   *internal_node_right_child(node) = INVALID_PAGE_NUM;
 }
 
+// Both node bodies start right after the common header, so moving the body
+// down is all a legacy page needs besides the new header.
+static void migrate_legacy_node(void *node) {
+  NodeType type = *(uint8_t *)(node + NODE_TYPE_OFFSET); // low byte of the enum
+  bool is_root = *(bool *)(node + LEGACY_IS_ROOT_OFFSET);
+  uint32_t parent;
+  memcpy(&parent, node + LEGACY_PARENT_POINTER_OFFSET, sizeof(parent));
+  if (type != NODE_INTERNAL && type != NODE_LEAF) {
+    fprintf(stderr, "Unknown node type %u. Corrupt file.\n", type);
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t shrink = LEGACY_NODE_HEADER_SIZE - COMMON_NODE_HEADER_SIZE;
+  memmove(node + COMMON_NODE_HEADER_SIZE, node + LEGACY_NODE_HEADER_SIZE,
+          PAGE_SIZE - LEGACY_NODE_HEADER_SIZE);
+  memset(node + PAGE_SIZE - shrink, 0, shrink);
+  set_node_type(node, type);
+  set_node_root(node, is_root);
+  set_node_version(node);
+  *node_parent(node) = parent;
+}
+
 static uint32_t get_node_max_key(Pager *pager, void *node) {
   switch (get_node_type(node)) {
   case NODE_INTERNAL: {
@@ -207,33 +269,633 @@ static uint32_t get_node_max_key(Pager *pager, void *node) {
 }
 
 /* Pager */
+#define PAGER_HASH_BUCKETS 1024
+#define WAL_CHECKPOINT_PAGES 1000
+
+typedef struct Frame_tag {
+  uint32_t page_num;
+  uint64_t pin_epoch; // pinned while equal to the pager's epoch
+  bool dirty;
+  bool in_txn;        // written by the open transaction
+  bool undo_dirty;    // dirty flag before the transaction wrote the page
+  void *undo;         // image before the transaction, NULL for new pages
+  struct Frame_tag *hash_next;
+  struct Frame_tag *lru_prev; // towards the most recently used frame
+  struct Frame_tag *lru_next; // towards the least recently used frame
+  void *data;
+} Frame;
+
+/*
+ * A snapshot reads the tree as it was when the snapshot was taken. Before
+ * a page that an open snapshot can see is overwritten, the old image is
+ * kept as a shadow page, valid for snapshots with from <= version < until.
+ */
+struct Snapshot_tag {
+  Pager *pager;
+  uint64_t version;
+  uint32_t num_pages; // committed page count when taken
+  struct Snapshot_tag *next;
+};
+
+typedef struct Shadow_tag {
+  uint32_t page_num;
+  uint64_t from;
+  uint64_t until;
+  void *data;
+  struct Shadow_tag *next; // newer shadows of a page come first
+} Shadow;
+
+typedef struct PageMapEntry_tag PageMapEntry;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t len;
+} Extent;
+
+typedef struct {
+  Extent *items;
+  uint32_t len;
+  uint32_t cap;
+} ExtentList;
+
 struct Pager_tag {
   int fd;
-  uint32_t file_len;
+  off_t file_len;
   uint32_t num_pages;
-  void *pages[TABLE_MAX_PAGES];
+  uint32_t num_frames;
+  uint64_t epoch;
+  Frame *lru_head;
+  Frame *lru_tail;
+  Frame *buckets[PAGER_HASH_BUCKETS];
+
+  /* Transaction */
+  bool in_txn;
+  uint32_t txn_num_pages; // num_pages when the transaction began
+  Frame *txn_frames;      // frames written by the transaction, linked by lru_next
+
+  /* Write-ahead log */
+  char *wal_path;
+  int wal_fd; // -1 until the first commit
+  off_t wal_len;
+
+  /* Compression, see FileHeader */
+  bool compressed;
+  void *zbuf;
+  PageMapEntry *page_map;
+  uint32_t page_map_len;
+  uint32_t page_map_cap;
+  uint64_t map_offset; // where the durable page map is
+  uint32_t map_len;
+  ExtentList free_extents;
+  ExtentList pending_extents; // released since the last sync
+  uint64_t pending_bytes;
+  bool map_dirty;
+
+  /* Snapshots */
+  uint64_t version; // stamp of writes made now
+  Snapshot *snapshots;
+  uint32_t snapshot_num_pages; // no open snapshot sees pages past this
+  Shadow *shadows[PAGER_HASH_BUCKETS];
+  uint32_t num_shadows;
+
+  PagerStats stats;
 };
 
-static Pager *pager_open(const char *filename) {
+/*
+ * The WAL is a redo log of committed transactions. Each transaction is a
+ * run of page records followed by a commit record whose checksum covers
+ * the run and the page count, so a torn tail is detected and ignored on
+ * recovery.
+ */
+typedef struct {
+  uint32_t page_num;  // INVALID_PAGE_NUM marks a commit record
+  uint32_t num_pages; // commit record: page count after the commit
+  uint32_t checksum;  // commit record: checksum of the page records and num_pages
+  uint32_t reserved;
+} WalRecord;
+
+static off_t page_offset(uint32_t page_num) {
+  // widen before multiplying, or offsets wrap at 4 GiB
+  return (off_t)page_num * PAGE_SIZE;
+}
+
+static uint32_t checksum(uint32_t hash, const void *buf, size_t len) {
+  // FNV-1a
+  const uint8_t *bytes = buf;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static const uint32_t CHECKSUM_SEED = 2166136261u;
+
+static void read_all(int fd, void *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t n = pread(fd, buf, len, offset);
+    if (n == -1) die("pread(2)");
+    if (n == 0) { // past end of file
+      memset(buf, 0, len);
+      return;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+}
+
+static void write_all(int fd, const void *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n == -1) die("pwrite(2)");
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+}
+
+// I/O on the pager's own files, counted and timed.
+static void pager_pread(Pager *p, int fd, void *buf, size_t len, off_t offset) {
+  uint64_t start = phase_begin();
+  read_all(fd, buf, len, offset);
+  p->stats.bytes_read += len;
+  phase_end(PHASE_IO_WAIT, start);
+}
+
+static void pager_pwrite(Pager *p, int fd, const void *buf, size_t len, off_t offset) {
+  uint64_t start = phase_begin();
+  write_all(fd, buf, len, offset);
+  p->stats.bytes_written += len;
+  phase_end(PHASE_IO_WAIT, start);
+}
+
+static void pager_fsync(int fd) {
+  uint64_t start = phase_begin();
+  if (fsync(fd) == -1) die("fsync(2)");
+  phase_end(PHASE_IO_WAIT, start);
+}
+
+/*
+ * Compressed file layout. The first sector holds a FileHeader. Each page
+ * is compressed into an extent of whole sectors, found through a page map
+ * that is itself stored in an extent. Extents are never overwritten: a
+ * page write takes a fresh extent, and the old one is reused only after a
+ * page map that no longer references it has been made durable.
+ */
+#define SECTOR_SIZE 512
+#define COMPRESSED_MAGIC "rdbz"
+#define COMPRESSED_FORMAT_VERSION 1
+// Sync the page map once this much space waits to be reused.
+#define PENDING_SYNC_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t num_pages;
+  uint32_t map_len;
+  uint64_t map_offset;
+} FileHeader;
+
+struct PageMapEntry_tag {
+  uint64_t offset; // 0 if the page has never been written
+  uint32_t len;    // compressed length, PAGE_SIZE if stored as is
+  uint32_t reserved;
+};
+
+static uint64_t round_to_sector(uint64_t len) {
+  return (len + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+}
+
+static void extent_list_push(ExtentList *l, uint64_t offset, uint64_t len) {
+  if (l->len == l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 64;
+    l->items = realloc(l->items, l->cap * sizeof(Extent));
+    if (!l->items) die("realloc");
+  }
+  l->items[l->len].offset = offset;
+  l->items[l->len].len = len;
+  l->len++;
+}
+
+static int compare_extents(const void *a, const void *b) {
+  uint64_t x = ((const Extent *)a)->offset;
+  uint64_t y = ((const Extent *)b)->offset;
+  return x < y ? -1 : x > y;
+}
+
+// First fit in the free list, else grow the file.
+static uint64_t zpager_alloc(Pager *p, uint64_t len) {
+  ExtentList *l = &p->free_extents;
+  for (uint32_t i = 0; i < l->len; i++) {
+    Extent *e = &l->items[i];
+    if (e->len >= len) {
+      uint64_t offset = e->offset;
+      e->offset += len;
+      e->len -= len;
+      if (e->len == 0) {
+        *e = l->items[--l->len];
+      }
+      return offset;
+    }
+  }
+  uint64_t offset = p->file_len;
+  p->file_len += len;
+  return offset;
+}
+
+static void zpager_release(Pager *p, uint64_t offset, uint64_t len) {
+  if (len == 0) {
+    return;
+  }
+  extent_list_push(&p->pending_extents, offset, len);
+  p->pending_bytes += len;
+}
+
+// Sort and merge the free list, and give a free tail back to the file system.
+static void zpager_coalesce(Pager *p) {
+  ExtentList *l = &p->free_extents;
+  if (l->len == 0) {
+    return;
+  }
+  qsort(l->items, l->len, sizeof(Extent), compare_extents);
+  uint32_t n = 0;
+  for (uint32_t i = 1; i < l->len; i++) {
+    Extent *last = &l->items[n];
+    if (last->offset + last->len == l->items[i].offset) {
+      last->len += l->items[i].len;
+    } else {
+      l->items[++n] = l->items[i];
+    }
+  }
+  l->len = n + 1;
+
+  Extent *tail = &l->items[l->len - 1];
+  if (tail->offset + tail->len == (uint64_t)p->file_len) {
+    if (ftruncate(p->fd, tail->offset) == -1) die("ftruncate(2)");
+    p->file_len = tail->offset;
+    l->len--;
+  }
+}
+
+static PageMapEntry *zpager_map_entry(Pager *p, uint32_t page_num) {
+  if (page_num >= p->page_map_len) {
+    uint32_t new_len = page_num + 1;
+    if (new_len > p->page_map_cap) {
+      uint32_t new_cap = p->page_map_cap ? p->page_map_cap : 64;
+      while (new_cap < new_len) {
+        new_cap *= 2;
+      }
+      p->page_map = realloc(p->page_map, new_cap * sizeof(PageMapEntry));
+      if (!p->page_map) die("realloc");
+      p->page_map_cap = new_cap;
+    }
+    memset(&p->page_map[p->page_map_len], 0,
+        (new_len - p->page_map_len) * sizeof(PageMapEntry));
+    p->page_map_len = new_len;
+  }
+  return &p->page_map[page_num];
+}
+
+static void zpager_read_page(Pager *p, uint32_t page_num, void *data) {
+  if (page_num >= p->page_map_len || p->page_map[page_num].offset == 0) {
+    memset(data, 0, PAGE_SIZE);
+    return;
+  }
+  PageMapEntry *e = &p->page_map[page_num];
+  if (e->len == PAGE_SIZE) {
+    pager_pread(p, p->fd, data, PAGE_SIZE, e->offset);
+    return;
+  }
+  pager_pread(p, p->fd, p->zbuf, e->len, e->offset);
+  if (!lz_decompress(p->zbuf, e->len, data, PAGE_SIZE)) {
+    fprintf(stderr, "Page %u does not decompress. Corrupt file.\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void zpager_write_page(Pager *p, uint32_t page_num, const void *data) {
+  // Pages that do not shrink are stored as is.
+  const void *buf = p->zbuf;
+  uint32_t len = lz_compress(data, PAGE_SIZE, p->zbuf, PAGE_SIZE - 1);
+  if (len == 0) {
+    buf = data;
+    len = PAGE_SIZE;
+  }
+
+  PageMapEntry *e = zpager_map_entry(p, page_num);
+  zpager_release(p, e->offset, round_to_sector(e->len));
+  e->offset = zpager_alloc(p, round_to_sector(len));
+  e->len = len;
+  pager_pwrite(p, p->fd, buf, len, e->offset);
+  p->map_dirty = true;
+}
+
+static void zpager_write_header(Pager *p) {
+  FileHeader h = {0};
+  memcpy(h.magic, COMPRESSED_MAGIC, sizeof(h.magic));
+  h.version = COMPRESSED_FORMAT_VERSION;
+  h.num_pages = p->in_txn ? p->txn_num_pages : p->num_pages;
+  h.map_offset = p->map_offset;
+  h.map_len = p->map_len;
+  pager_pwrite(p, p->fd, &h, sizeof(h), 0);
+}
+
+// Make the page map durable, after which released extents can be reused.
+static void zpager_sync(Pager *p) {
+  uint64_t old_offset = p->map_offset;
+  uint64_t old_len = round_to_sector(p->map_len);
+
+  p->map_len = p->page_map_len * sizeof(PageMapEntry);
+  p->map_offset = zpager_alloc(p, round_to_sector(p->map_len));
+  pager_pwrite(p, p->fd, p->page_map, p->map_len, p->map_offset);
+  pager_fsync(p->fd);
+  zpager_write_header(p);
+  pager_fsync(p->fd);
+
+  zpager_release(p, old_offset, old_len);
+  for (uint32_t i = 0; i < p->pending_extents.len; i++) {
+    Extent *e = &p->pending_extents.items[i];
+    extent_list_push(&p->free_extents, e->offset, e->len);
+  }
+  p->pending_extents.len = 0;
+  p->pending_bytes = 0;
+  p->map_dirty = false;
+  zpager_coalesce(p);
+}
+
+static void zpager_open(Pager *p, bool is_new) {
+  p->compressed = true;
+  p->zbuf = malloc(lz_compress_bound(PAGE_SIZE));
+  if (!p->zbuf) die("malloc");
+
+  if (is_new) {
+    p->file_len = SECTOR_SIZE;
+    zpager_write_header(p);
+    return;
+  }
+
+  // The page map may end mid-sector. Keep new extents aligned.
+  p->file_len = round_to_sector(p->file_len);
+
+  FileHeader h;
+  pager_pread(p, p->fd, &h, sizeof(h), 0);
+  if (h.version != COMPRESSED_FORMAT_VERSION
+      || h.map_len % sizeof(PageMapEntry) != 0
+      || h.map_offset + h.map_len > (uint64_t)p->file_len) {
+    fprintf(stderr, "Unsupported compressed db file. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+  p->num_pages = h.num_pages;
+  p->map_offset = h.map_offset;
+  p->map_len = h.map_len;
+  p->page_map_len = p->page_map_cap = h.map_len / sizeof(PageMapEntry);
+  p->page_map = malloc(h.map_len ? h.map_len : 1);
+  if (!p->page_map) die("malloc");
+  pager_pread(p, p->fd, p->page_map, h.map_len, h.map_offset);
+
+  // Whatever the page map does not reference is free.
+  ExtentList used = {0};
+  extent_list_push(&used, 0, SECTOR_SIZE);
+  extent_list_push(&used, p->map_offset, round_to_sector(p->map_len));
+  for (uint32_t i = 0; i < p->page_map_len; i++) {
+    if (p->page_map[i].offset != 0) {
+      extent_list_push(&used, p->page_map[i].offset,
+          round_to_sector(p->page_map[i].len));
+    }
+  }
+  qsort(used.items, used.len, sizeof(Extent), compare_extents);
+  uint64_t end = 0;
+  for (uint32_t i = 0; i < used.len; i++) {
+    if (used.items[i].offset > end) {
+      extent_list_push(&p->free_extents, end, used.items[i].offset - end);
+    }
+    if (used.items[i].offset + used.items[i].len > end) {
+      end = used.items[i].offset + used.items[i].len;
+    }
+  }
+  if ((uint64_t)p->file_len > end) {
+    extent_list_push(&p->free_extents, end, p->file_len - end);
+  }
+  free(used.items);
+  zpager_coalesce(p);
+}
+
+static bool is_compressed_file(int fd, off_t file_len) {
+  char magic[sizeof(COMPRESSED_MAGIC) - 1];
+  if (file_len < SECTOR_SIZE) {
+    return false;
+  }
+  read_all(fd, magic, sizeof(magic), 0);
+  return memcmp(magic, COMPRESSED_MAGIC, sizeof(magic)) == 0;
+}
+
+static void pager_read_page(Pager *p, uint32_t page_num, void *data) {
+  p->stats.pages_read++;
+  if (p->compressed) {
+    zpager_read_page(p, page_num, data);
+  } else {
+    pager_pread(p, p->fd, data, PAGE_SIZE, page_offset(page_num));
+  }
+}
+
+static void pager_write_page(Pager *p, uint32_t page_num, const void *data) {
+  p->stats.pages_written++;
+  if (p->compressed) {
+    zpager_write_page(p, page_num, data);
+    return;
+  }
+  off_t offset = page_offset(page_num);
+  pager_pwrite(p, p->fd, data, PAGE_SIZE, offset);
+  if (offset + PAGE_SIZE > p->file_len) {
+    p->file_len = offset + PAGE_SIZE;
+  }
+}
+
+PagerStats pager_stats(Pager *p) {
+  PagerStats stats = p->stats;
+  stats.cached_pages = p->num_frames;
+  stats.cache_capacity = PAGER_MAX_CACHED_PAGES;
+  stats.file_pages = p->num_pages;
+  stats.shadow_pages = p->num_shadows;
+  return stats;
+}
+
+// Make every page written so far durable.
+static void pager_sync(Pager *p) {
+  if (p->compressed) {
+    zpager_sync(p);
+  } else {
+    pager_fsync(p->fd);
+  }
+}
+
+// Make everything in the WAL durable in the db file, then empty the WAL.
+static void pager_checkpoint(Pager *p) {
+  if (p->wal_len == 0) {
+    return;
+  }
+  pager_sync(p);
+  if (ftruncate(p->wal_fd, 0) == -1) die("ftruncate(2)");
+  p->wal_len = 0;
+}
+
+// Replay the committed transactions of a WAL left behind by a crash.
+static void pager_recover(Pager *p) {
+  int wal_fd = open(p->wal_path, O_RDWR);
+  if (wal_fd == -1) {
+    return;
+  }
+  off_t wal_len = lseek(wal_fd, 0, SEEK_END);
+  if (wal_len == -1) die("lseek");
+
+  void *page = malloc(PAGE_SIZE);
+  off_t txn_start = 0;
+  off_t offset = 0;
+  uint32_t sum = CHECKSUM_SEED;
+  WalRecord rec;
+  while (offset + (off_t)sizeof(rec) <= wal_len) {
+    pager_pread(p, wal_fd, &rec, sizeof(rec), offset);
+    offset += sizeof(rec);
+
+    if (rec.page_num != INVALID_PAGE_NUM) {
+      if (offset + PAGE_SIZE > wal_len) {
+        break;
+      }
+      pager_pread(p, wal_fd, page, PAGE_SIZE, offset);
+      offset += PAGE_SIZE;
+      sum = checksum(sum, &rec.page_num, sizeof(rec.page_num));
+      sum = checksum(sum, page, PAGE_SIZE);
+      continue;
+    }
+
+    sum = checksum(sum, &rec.num_pages, sizeof(rec.num_pages));
+    if (rec.checksum != sum) {
+      break;
+    }
+    // Complete transaction, apply its pages.
+    for (off_t o = txn_start; o < offset - (off_t)sizeof(rec); o += sizeof(rec) + PAGE_SIZE) {
+      WalRecord page_rec;
+      pager_pread(p, wal_fd, &page_rec, sizeof(page_rec), o);
+      pager_pread(p, wal_fd, page, PAGE_SIZE, o + sizeof(page_rec));
+      pager_write_page(p, page_rec.page_num, page);
+    }
+    if (rec.num_pages > p->num_pages) {
+      p->num_pages = rec.num_pages;
+    }
+    txn_start = offset;
+    sum = CHECKSUM_SEED;
+  }
+  free(page);
+
+  pager_sync(p);
+  if (close(wal_fd) == -1) die("close(2)");
+  if (unlink(p->wal_path) == -1) die("unlink(2)");
+}
+
+static void *get_page_for_write(Pager *p, uint32_t page_num);
+static void pager_begin(Pager *p);
+static void pager_commit(Pager *p);
+static HotIndex *hot_index_new(void);
+
+// Rewrite the pages of a file from before NODE_FORMAT_VERSION. Shifting a
+// page's body cannot be redone over a torn write, so the pages go through
+// the WAL like any transaction, in transactions of at most a checkpoint's
+// worth. Page 0 is in the last one: a migration cut short is finished by
+// the next open, which skips the pages already done.
+static void pager_migrate(Pager *p) {
+  if (p->num_pages == 0) {
+    return;
+  }
+  uint8_t version = node_version(get_page(p, 0));
+  if (version > NODE_FORMAT_VERSION) {
+    fprintf(stderr, "Db file has node format %u, newer than %u.\n",
+            version, NODE_FORMAT_VERSION);
+    exit(EXIT_FAILURE);
+  }
+  if (version == 0) {
+    pager_begin(p);
+    for (uint32_t page_num = 1; page_num < p->num_pages; page_num++) {
+      if (node_version(get_page(p, page_num)) == 0) {
+        migrate_legacy_node(get_page_for_write(p, page_num));
+      }
+      pager_unpin_all(p);
+      if (page_num % WAL_CHECKPOINT_PAGES == 0) {
+        pager_commit(p);
+        pager_begin(p);
+      }
+    }
+    migrate_legacy_node(get_page_for_write(p, 0));
+    pager_commit(p);
+    pager_checkpoint(p);
+  }
+  pager_unpin_all(p);
+}
+
+static Pager *pager_open(const char *filename, bool compress) {
   int fd = open(filename, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
   if (fd == -1) die("open(2)");
 
   off_t file_len = lseek(fd, 0, SEEK_END);
   if (file_len == -1) die("lseek");
 
+  bool compressed = is_compressed_file(fd, file_len);
+  if (!compressed && file_len % PAGE_SIZE != 0) {
+    fprintf(stderr, "Db file is not a whole number of pages. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (file_len / PAGE_SIZE >= INVALID_PAGE_NUM) {
+    fprintf(stderr, "Db file has more pages than can be addressed. Corrupt file.\n");
+    exit(EXIT_FAILURE);
+  }
+
   Pager *pager = malloc(sizeof(Pager));
+  if (!pager) die("malloc");
   pager->fd = fd;
   pager->file_len = file_len;
   pager->num_pages = (file_len / PAGE_SIZE);
+  pager->num_frames = 0;
+  pager->epoch = 0;
+  pager->stats = (PagerStats){0};
+  pager->lru_head = NULL;
+  pager->lru_tail = NULL;
+  for (uint32_t i = 0; i < PAGER_HASH_BUCKETS; i++) {
+    pager->buckets[i] = NULL;
+  }
 
-  if (file_len % PAGE_SIZE != 0) {
-    fprintf(stderr, "Db file is not a whole number of pages. Corrupt file.\n");
-    exit(EXIT_FAILURE);
+  pager->in_txn = false;
+  pager->txn_num_pages = 0;
+  pager->txn_frames = NULL;
+
+  pager->wal_path = malloc(strlen(filename) + sizeof("-wal"));
+  if (!pager->wal_path) die("malloc");
+  sprintf(pager->wal_path, "%s-wal", filename);
+  pager->wal_fd = -1;
+  pager->wal_len = 0;
+
+  pager->compressed = false;
+  pager->zbuf = NULL;
+  pager->page_map = NULL;
+  pager->page_map_len = pager->page_map_cap = 0;
+  pager->map_offset = 0;
+  pager->map_len = 0;
+  pager->free_extents = (ExtentList){0};
+  pager->pending_extents = (ExtentList){0};
+  pager->pending_bytes = 0;
+  pager->map_dirty = false;
+  if (compressed || (compress && file_len == 0)) {
+    zpager_open(pager, !compressed);
   }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+  pager->version = 0;
+  pager->snapshots = NULL;
+  pager->snapshot_num_pages = 0;
+  for (uint32_t i = 0; i < PAGER_HASH_BUCKETS; i++) {
+    pager->shadows[i] = NULL;
   }
+  pager->num_shadows = 0;
+
+  pager_recover(pager);
+  pager_migrate(pager);
 
   return pager;
 }
@@ -242,65 +904,421 @@ static uint32_t get_unused_page_num(Pager *p) {
   return p->num_pages;
 }
 
-static void pager_flush(Pager *p, uint32_t page_num) {
-  if (p->pages[page_num] == NULL) {
+static Frame **pager_bucket(Pager *p, uint32_t page_num) {
+  return &p->buckets[page_num % PAGER_HASH_BUCKETS];
+}
+
+static Frame *pager_lookup(Pager *p, uint32_t page_num) {
+  for (Frame *f = *pager_bucket(p, page_num); f; f = f->hash_next) {
+    if (f->page_num == page_num) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+static void pager_unlink(Pager *p, Frame *f) {
+  Frame **link = pager_bucket(p, f->page_num);
+  while (*link != f) {
+    link = &(*link)->hash_next;
+  }
+  *link = f->hash_next;
+  f->hash_next = NULL;
+}
+
+static void lru_unlink(Pager *p, Frame *f) {
+  if (f->lru_prev) f->lru_prev->lru_next = f->lru_next;
+  else p->lru_head = f->lru_next;
+  if (f->lru_next) f->lru_next->lru_prev = f->lru_prev;
+  else p->lru_tail = f->lru_prev;
+  f->lru_prev = f->lru_next = NULL;
+}
+
+static void lru_push_front(Pager *p, Frame *f) {
+  f->lru_prev = NULL;
+  f->lru_next = p->lru_head;
+  if (p->lru_head) p->lru_head->lru_prev = f;
+  else p->lru_tail = f;
+  p->lru_head = f;
+}
+
+static void pager_flush(Pager *p, Frame *f) {
+  if (!f->dirty) {
     return;
   }
-  if(lseek(p->fd, page_num * PAGE_SIZE, SEEK_SET) == -1) die("lseek");
-  if(write(p->fd, p->pages[page_num], PAGE_SIZE) == -1) die("write(2)");
+  // Pages written outside a transaction must not be overwritten by an
+  // older image from the WAL during recovery.
+  pager_checkpoint(p);
+  pager_write_page(p, f->page_num, f->data);
+  f->dirty = false;
+  p->stats.flushes++;
 }
 
-static void pager_free(Pager *p) {
-  for (uint32_t i = 0; i < p->num_pages; i++) {
-    pager_flush(p, i);
-    free(p->pages[i]);
-    p->pages[i] = NULL;
+// Write the frame back and drop it from the cache. The frame itself is
+// unlinked but not freed, so the caller can reuse or release it.
+static void pager_evict(Pager *p, Frame *f) {
+  pager_flush(p, f);
+  lru_unlink(p, f);
+  pager_unlink(p, f);
+}
+
+static void free_frame(Frame *f) {
+  free(f->undo);
+  free(f->data);
+  free(f);
+}
+
+// Returns a detached frame, evicting the least recently used one when the
+// cache is full. Pinned frames are never evicted; if every frame is pinned
+// the cache grows past its limit until the next pager_unpin_all().
+// Frames written by the open transaction are not on the LRU list, so they
+// stay cached until it ends.
+static Frame *pager_alloc_frame(Pager *p) {
+  Frame *victim = p->lru_tail;
+  if (p->num_frames >= PAGER_MAX_CACHED_PAGES
+      && victim && victim->pin_epoch != p->epoch) {
+    pager_evict(p, victim);
+    return victim;
   }
 
-  if (close(p->fd) == -1) die("close(2)");
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void *page = p->pages[i];
-    if (page) {
-      free(page);
-      p->pages[i] = NULL;
-    }
+  Frame *f = malloc(sizeof(Frame));
+  if (!f) die("malloc");
+  f->data = malloc(PAGE_SIZE);
+  if (!f->data) die("malloc");
+  f->hash_next = f->lru_prev = f->lru_next = NULL;
+  p->num_frames++;
+  return f;
+}
+
+void pager_unpin_all(Pager *p) {
+  p->epoch++;
+  while (p->num_frames > PAGER_MAX_CACHED_PAGES && p->lru_tail) {
+    Frame *victim = p->lru_tail;
+    pager_evict(p, victim);
+    free_frame(victim);
+    p->num_frames--;
+  }
+  if (p->pending_bytes >= PENDING_SYNC_BYTES) {
+    zpager_sync(p);
   }
-  free(p);
 }
 
-void *get_page(Pager *p, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    fprintf(stderr, "Tried to fetch page number out of bounds. %d > %d\n",
-        page_num, TABLE_MAX_PAGES);
+static Frame *pager_get_frame(Pager *p, uint32_t page_num) {
+  if (page_num == INVALID_PAGE_NUM) {
+    fprintf(stderr, "Tried to fetch invalid page number %u.\n", page_num);
     exit(EXIT_FAILURE);
   }
 
-  if (p->pages[page_num] == NULL) {
-    // Cache miss. Allocate memory and load from file.
-    void *page = malloc(PAGE_SIZE);
-    p->pages[page_num] = page;
+  Frame *f = pager_lookup(p, page_num);
+  if (f == NULL) {
+    // Cache miss. Take a frame and load from file.
+    p->stats.misses++;
+    f = pager_alloc_frame(p);
+    f->page_num = page_num;
+    f->dirty = false;
+    f->in_txn = false;
+    f->undo = NULL;
+    f->hash_next = *pager_bucket(p, page_num);
+    *pager_bucket(p, page_num) = f;
+    lru_push_front(p, f);
 
     if (page_num < p->num_pages) { /* page is in file */
-      if (lseek(p->fd, page_num * PAGE_SIZE, SEEK_SET) == -1) die("lseek");
-      if (read(p->fd, page, PAGE_SIZE) == -1) die("read(2)");
+      pager_read_page(p, page_num, f->data);
     } else { /* page is not in file */
+      memset(f->data, 0, PAGE_SIZE);
       p->num_pages = page_num + 1;
     }
+  } else {
+    p->stats.hits++;
+    if (!f->in_txn && f != p->lru_head) {
+      lru_unlink(p, f);
+      lru_push_front(p, f);
+    }
+  }
+
+  f->pin_epoch = p->epoch;
+  return f;
+}
+
+void *get_page(Pager *p, uint32_t page_num) {
+  return pager_get_frame(p, page_num)->data;
+}
+
+static Shadow *pager_latest_shadow(Pager *p, uint32_t page_num) {
+  for (Shadow *s = p->shadows[page_num % PAGER_HASH_BUCKETS]; s; s = s->next) {
+    if (s->page_num == page_num) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static bool pager_snapshot_between(Pager *p, uint64_t from, uint64_t until) {
+  for (Snapshot *snap = p->snapshots; snap; snap = snap->next) {
+    if (from <= snap->version && snap->version < until) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether an open snapshot reads the current image of a page, so it must
+// be kept as a shadow before the page changes. Sets the shadow's from.
+static bool pager_needs_shadow(Pager *p, uint32_t page_num, uint64_t *from) {
+  if (page_num >= p->snapshot_num_pages) {
+    return false; // allocated after every open snapshot
+  }
+  Shadow *latest = pager_latest_shadow(p, page_num);
+  *from = latest ? latest->until : 0;
+  return pager_snapshot_between(p, *from, p->version);
+}
+
+// Takes ownership of image.
+static void pager_add_shadow(Pager *p, uint32_t page_num, uint64_t from, void *image) {
+  Shadow *s = malloc(sizeof(Shadow));
+  if (!s) die("malloc");
+  s->page_num = page_num;
+  s->from = from;
+  s->until = p->version;
+  s->data = image;
+  s->next = p->shadows[page_num % PAGER_HASH_BUCKETS];
+  p->shadows[page_num % PAGER_HASH_BUCKETS] = s;
+  p->num_shadows++;
+}
+
+static void *copy_page(const void *src) {
+  void *dst = malloc(PAGE_SIZE);
+  if (!dst) die("malloc");
+  memcpy(dst, src, PAGE_SIZE);
+  return dst;
+}
+
+// Like get_page, but for a page the caller is about to modify. Inside a
+// transaction the page's current image is saved first so it can be
+// rolled back, and an image that open snapshots read is preserved.
+static void *get_page_for_write(Pager *p, uint32_t page_num) {
+  Frame *f = pager_get_frame(p, page_num);
+  // Pages written by the open transaction are preserved from their undo
+  // image at commit.
+  uint64_t from;
+  if (p->snapshots && !f->in_txn && pager_needs_shadow(p, page_num, &from)) {
+    pager_add_shadow(p, page_num, from, copy_page(f->data));
+  }
+  if (p->in_txn && !f->in_txn) {
+    if (page_num < p->txn_num_pages) {
+      f->undo = copy_page(f->data);
+    }
+    f->undo_dirty = f->dirty;
+    f->in_txn = true;
+    lru_unlink(p, f);
+    f->lru_next = p->txn_frames;
+    p->txn_frames = f;
+  }
+  f->dirty = true;
+  return f->data;
+}
+
+static void pager_begin(Pager *p) {
+  assert(!p->in_txn);
+  p->in_txn = true;
+  p->txn_num_pages = p->num_pages;
+  p->txn_frames = NULL;
+}
+
+// Hand the frame written by the transaction back to the LRU list.
+static void pager_end_txn_frame(Pager *p, Frame *f) {
+  free(f->undo);
+  f->undo = NULL;
+  f->in_txn = false;
+  lru_push_front(p, f);
+}
+
+static void pager_commit(Pager *p) {
+  assert(p->in_txn);
+  if (p->txn_frames == NULL) {
+    p->in_txn = false;
+    return;
+  }
+
+  if (p->wal_fd == -1) {
+    p->wal_fd = open(p->wal_path, O_RDWR|O_CREAT|O_TRUNC, S_IWUSR|S_IRUSR);
+    if (p->wal_fd == -1) die("open(2)");
+  }
+
+  // Log every page, then make the log durable. That fsync is the commit.
+  uint32_t sum = CHECKSUM_SEED;
+  WalRecord rec = {0};
+  for (Frame *f = p->txn_frames; f; f = f->lru_next) {
+    rec.page_num = f->page_num;
+    pager_pwrite(p, p->wal_fd, &rec, sizeof(rec), p->wal_len);
+    pager_pwrite(p, p->wal_fd, f->data, PAGE_SIZE, p->wal_len + sizeof(rec));
+    p->wal_len += sizeof(rec) + PAGE_SIZE;
+    sum = checksum(sum, &rec.page_num, sizeof(rec.page_num));
+    sum = checksum(sum, f->data, PAGE_SIZE);
+  }
+  rec.page_num = INVALID_PAGE_NUM;
+  rec.num_pages = p->num_pages;
+  rec.checksum = checksum(sum, &rec.num_pages, sizeof(rec.num_pages));
+  pager_pwrite(p, p->wal_fd, &rec, sizeof(rec), p->wal_len);
+  p->wal_len += sizeof(rec);
+  pager_fsync(p->wal_fd);
+
+  // The pages are safe in the WAL. Write them in place without waiting for
+  // the disk; recovery replays the WAL if we crash before a checkpoint.
+  Frame *f = p->txn_frames;
+  while (f) {
+    Frame *next = f->lru_next;
+    pager_write_page(p, f->page_num, f->data);
+    f->dirty = false;
+    uint64_t from;
+    if (f->undo && p->snapshots && pager_needs_shadow(p, f->page_num, &from)) {
+      pager_add_shadow(p, f->page_num, from, f->undo);
+      f->undo = NULL;
+    }
+    pager_end_txn_frame(p, f);
+    f = next;
+  }
+  p->txn_frames = NULL;
+  p->in_txn = false;
+
+  if (p->wal_len >= (off_t)WAL_CHECKPOINT_PAGES * PAGE_SIZE) {
+    pager_checkpoint(p);
+  }
+}
+
+static void pager_rollback(Pager *p) {
+  assert(p->in_txn);
+  Frame *f = p->txn_frames;
+  while (f) {
+    Frame *next = f->lru_next;
+    if (f->page_num >= p->txn_num_pages) {
+      // Page was allocated by the transaction.
+      pager_unlink(p, f);
+      free_frame(f);
+      p->num_frames--;
+    } else {
+      memcpy(f->data, f->undo, PAGE_SIZE);
+      f->dirty = f->undo_dirty;
+      pager_end_txn_frame(p, f);
+    }
+    f = next;
+  }
+  p->txn_frames = NULL;
+  p->num_pages = p->txn_num_pages;
+  p->in_txn = false;
+}
+
+static Snapshot *pager_snapshot(Pager *p) {
+  Snapshot *snap = malloc(sizeof(Snapshot));
+  if (!snap) die("malloc");
+  snap->pager = p;
+  // Writes from now on get a newer stamp than the snapshot.
+  snap->version = p->version++;
+  snap->next = p->snapshots;
+  p->snapshots = snap;
+
+  snap->num_pages = p->in_txn ? p->txn_num_pages : p->num_pages;
+  if (snap->num_pages > p->snapshot_num_pages) {
+    p->snapshot_num_pages = snap->num_pages;
+  }
+  return snap;
+}
+
+// The page as the snapshot sees it. The pointer is valid until the next
+// pager_unpin_all() or until the snapshot is released.
+static void *snapshot_get_page(Snapshot *snap, uint32_t page_num) {
+  Pager *p = snap->pager;
+  for (Shadow *s = p->shadows[page_num % PAGER_HASH_BUCKETS]; s; s = s->next) {
+    if (s->page_num == page_num
+        && s->from <= snap->version && snap->version < s->until) {
+      return s->data;
+    }
+  }
+  Frame *f = pager_get_frame(p, page_num);
+  if (f->in_txn && f->undo) {
+    // Written by the open transaction, which no snapshot sees.
+    return f->undo;
+  }
+  return f->data;
+}
+
+// Free the shadow pages no open snapshot reads.
+static void pager_reclaim_shadows(Pager *p) {
+  for (uint32_t i = 0; i < PAGER_HASH_BUCKETS; i++) {
+    Shadow **link = &p->shadows[i];
+    while (*link) {
+      Shadow *s = *link;
+      if (pager_snapshot_between(p, s->from, s->until)) {
+        link = &s->next;
+      } else {
+        *link = s->next;
+        free(s->data);
+        free(s);
+        p->num_shadows--;
+      }
+    }
+  }
+  if (p->snapshots == NULL) {
+    p->snapshot_num_pages = 0;
+  }
+}
+
+void snapshot_release(Snapshot *snap) {
+  Pager *p = snap->pager;
+  Snapshot **link = &p->snapshots;
+  while (*link != snap) {
+    link = &(*link)->next;
+  }
+  *link = snap->next;
+  free(snap);
+  pager_reclaim_shadows(p);
+}
+
+static void pager_free(Pager *p) {
+  if (p->in_txn) {
+    pager_rollback(p);
+  }
+  while (p->snapshots) {
+    snapshot_release(p->snapshots);
+  }
+
+  Frame *f = p->lru_head;
+  while (f) {
+    Frame *next = f->lru_next;
+    pager_flush(p, f);
+    free_frame(f);
+    f = next;
   }
 
-  return p->pages[page_num];
+  if (p->wal_fd != -1) {
+    pager_checkpoint(p);
+    if (close(p->wal_fd) == -1) die("close(2)");
+    if (unlink(p->wal_path) == -1) die("unlink(2)");
+  }
+  if (p->compressed && p->map_dirty) {
+    zpager_sync(p);
+  }
+  if (close(p->fd) == -1) die("close(2)");
+  free(p->wal_path);
+  free(p->zbuf);
+  free(p->page_map);
+  free(p->free_extents.items);
+  free(p->pending_extents.items);
+  free(p);
 }
 
 /* Table */
-Table *db_open(const char *filename) {
-  Pager *p = pager_open(filename);
+Table *db_open(const char *filename, bool compress) {
+  Pager *p = pager_open(filename, compress);
 
   Table *table = malloc(sizeof(Table));
   table->pager = p;
   table->root_page_num = 0;
+  table->hot_index = hot_index_new();
+  table->stats = (TreeStats){0};
   if (p->num_pages == 0) {
     // New database file. Initialize page 0 as leaf node.
-    void *root_node = get_page(p, 0);
+    void *root_node = get_page_for_write(p, 0);
     initialize_leaf_node(root_node);
     set_node_root(root_node, true);
   }
@@ -309,23 +1327,182 @@ Table *db_open(const char *filename) {
 
 void db_close(Table *table) {
   pager_free(table->pager);
+  free(table->hot_index);
   free(table);
 }
 
+bool db_in_transaction(Table *table) {
+  return table->pager->in_txn;
+}
+
+void db_begin(Table *table) {
+  pager_begin(table->pager);
+}
+
+void db_commit(Table *table) {
+  pager_commit(table->pager);
+}
+
+void db_rollback(Table *table) {
+  pager_rollback(table->pager);
+}
+
+Snapshot *db_snapshot(Table *table) {
+  return pager_snapshot(table->pager);
+}
+
+/* Backup */
+#define COPY_MAX_SIZE (64 << 20) // per system call
+#define COPY_BUFFER_SIZE (1 << 20)
+
+static bool copy_unsupported(int err) {
+  return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP;
+}
+
+static bool pwrite_fully(int fd, const char *buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// Copies the first len bytes of in to out. Uses copy_file_range, which can
+// share extents instead of copying them, then sendfile, then read and
+// write, as the kernel and file systems allow.
+static bool copy_file(int in, int out, off_t len) {
+  bool use_copy_range = true;
+  bool use_sendfile = true;
+  char *buf = NULL;
+  off_t offset = 0;
+  while (offset < len) {
+    size_t want = len - offset < COPY_MAX_SIZE ? len - offset : COPY_MAX_SIZE;
+    off_t in_off = offset;
+    off_t out_off = offset;
+    ssize_t n;
+    if (use_copy_range) {
+      n = copy_file_range(in, &in_off, out, &out_off, want, 0);
+      if (n == -1 && offset == 0 && copy_unsupported(errno)) {
+        use_copy_range = false;
+        continue;
+      }
+    } else if (use_sendfile) {
+      if (lseek(out, offset, SEEK_SET) == -1) break;
+      n = sendfile(out, in, &in_off, want);
+      if (n == -1 && offset == 0 && copy_unsupported(errno)) {
+        use_sendfile = false;
+        continue;
+      }
+    } else {
+      if (!buf && !(buf = malloc(COPY_BUFFER_SIZE))) die("malloc");
+      n = pread(in, buf, want < COPY_BUFFER_SIZE ? want : COPY_BUFFER_SIZE, offset);
+      if (n > 0 && !pwrite_fully(out, buf, n, offset)) {
+        n = -1;
+      }
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == 0) {
+      errno = EIO; // the file is shorter than it was
+    }
+    if (n <= 0) {
+      break;
+    }
+    offset += n;
+  }
+  free(buf);
+  return offset == len;
+}
+
+static bool fsync_parent_dir(const char *path) {
+  char *copy = strdup(path);
+  if (!copy) die("strdup");
+  int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+  free(copy);
+  if (fd == -1) {
+    return false;
+  }
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+bool db_backup(Table *table, const char *path) {
+  Pager *p = table->pager;
+  assert(!p->in_txn);
+
+  // Leave everything committed in the db file itself, with no WAL to replay.
+  for (Frame *f = p->lru_head; f; f = f->lru_next) {
+    pager_flush(p, f);
+  }
+  pager_checkpoint(p);
+  if (p->compressed && p->map_dirty) {
+    zpager_sync(p);
+  }
+  off_t len = lseek(p->fd, 0, SEEK_END);
+  if (len == -1) die("lseek");
+
+  // Write next to path and rename, so an earlier backup survives a failure.
+  char *tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+  if (!tmp_path) die("malloc");
+  sprintf(tmp_path, "%s.tmp", path);
+  int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, S_IWUSR|S_IRUSR);
+  if (fd == -1) {
+    free(tmp_path);
+    return false;
+  }
+  uint64_t start = phase_begin();
+  bool ok = copy_file(p->fd, fd, len) && fsync(fd) == 0;
+  phase_end(PHASE_IO_WAIT, start);
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(tmp_path, path) == 0 && fsync_parent_dir(path);
+  if (!ok) {
+    int err = errno;
+    unlink(tmp_path);
+    errno = err;
+  }
+  free(tmp_path);
+  return ok;
+}
+
 /* Cursor */
-Cursor *table_start(Table *table) {
-  Cursor *c = table_find(table, 0);
-  void *node = get_page(table->pager, c->page_num);
+static void *read_page(Table *table, Snapshot *snapshot, uint32_t page_num) {
+  if (snapshot) {
+    return snapshot_get_page(snapshot, page_num);
+  }
+  return get_page(table->pager, page_num);
+}
+
+static Cursor *table_seek(Table *table, Snapshot *snapshot, uint32_t key);
+
+Cursor *table_start(Table *table, Snapshot *snapshot) {
+  Cursor *c = table_seek(table, snapshot, 0);
+  void *node = read_page(table, snapshot, c->page_num);
   c->end_of_table = (*leaf_node_num_cells(node) == 0);
   return c;
 }
 
-static Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key) {
-  void *node = get_page(table->pager, page_num);
+static Cursor *leaf_node_find(
+  Table *table,
+  Snapshot *snapshot,
+  uint32_t page_num,
+  uint32_t key
+) {
+  void *node = read_page(table, snapshot, page_num);
   uint32_t num_cells = *leaf_node_num_cells(node);
 
   Cursor *c = malloc(sizeof(Cursor));
   c->table = table;
+  c->snapshot = snapshot;
   c->page_num = page_num;
 
   // Binary search
@@ -375,38 +1552,165 @@ static uint32_t internal_node_find_child(void *node, uint32_t key) {
   return min_idx;
 }
 
-static Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key)  {
-  void *node = get_page(table->pager, page_num);
+static Cursor *internal_node_find(
+  Table *table,
+  Snapshot *snapshot,
+  uint32_t page_num,
+  uint32_t key
+) {
+  void *node = read_page(table, snapshot, page_num);
   uint32_t child_idx = internal_node_find_child(node, key);
   uint32_t child_num = *internal_node_child(node, child_idx);
-  void *child = get_page(table->pager, child_num);
+  void *child = read_page(table, snapshot, child_num);
+  table->stats.descent_nodes++;
   switch (get_node_type(child)) {
   case NODE_LEAF:
-    return leaf_node_find(table, child_num, key);
+    return leaf_node_find(table, snapshot, child_num, key);
   case NODE_INTERNAL:
-    return internal_node_find(table, child_num, key);
+    return internal_node_find(table, snapshot, child_num, key);
   }
   assert(false);
 }
 
-Cursor *table_find(Table *table, uint32_t key) {
+static Cursor *table_seek(Table *table, Snapshot *snapshot, uint32_t key) {
+  uint64_t start = phase_begin();
   uint32_t root_page_num = table->root_page_num;
-  void *root_node = get_page(table->pager, root_page_num);
+  void *root_node = read_page(table, snapshot, root_page_num);
+  table->stats.descents++;
+  table->stats.descent_nodes++;
 
+  Cursor *c;
   if (get_node_type(root_node) == NODE_LEAF) {
-    return leaf_node_find(table, root_page_num, key);
+    c = leaf_node_find(table, snapshot, root_page_num, key);
   } else {
-    return internal_node_find(table, root_page_num, key);
+    c = internal_node_find(table, snapshot, root_page_num, key);
+  }
+  phase_end(PHASE_DESCENT, start);
+  return c;
+}
+
+Cursor *table_find(Table *table, uint32_t key) {
+  return table_seek(table, NULL, key);
+}
+
+uint32_t table_height(Table *table, Snapshot *snapshot) {
+  // .stats reports the height, so the walk must not count as cache use.
+  PagerStats saved = table->pager->stats;
+  uint32_t height = 1;
+  void *node = read_page(table, snapshot, table->root_page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    node = read_page(table, snapshot, *internal_node_child(node, 0));
+    height++;
+  }
+  table->pager->stats = saved;
+  return height;
+}
+
+/* Hot Key Index */
+#define HOT_INDEX_SLOTS 4096 // power of two
+#define HOT_INDEX_MIN_HITS 3  // lookups before a key's position is cached
+#define HOT_INDEX_MAX_HITS 64 // so a key that goes cold loses its slot
+
+/*
+ * Direct-mapped cache from key to leaf cell. A slot counts lookups of its
+ * key; a lookup of another key decays the count and takes over the slot
+ * when it reaches zero, so only keys looked up more often than their
+ * neighbours keep a slot. Cached positions are only hints: a probe checks
+ * the leaf before trusting one, and splits invalidate them all.
+ */
+typedef struct {
+  uint32_t key;
+  uint32_t hits;
+  uint32_t page_num; // INVALID_PAGE_NUM until the key is hot
+  uint32_t cell_num;
+  uint32_t generation;
+} HotSlot;
+
+struct HotIndex_tag {
+  uint32_t generation;
+  HotSlot slots[HOT_INDEX_SLOTS];
+};
+
+static HotIndex *hot_index_new(void) {
+  HotIndex *index = malloc(sizeof(HotIndex));
+  if (!index) die("malloc");
+  index->generation = 0;
+  for (uint32_t i = 0; i < HOT_INDEX_SLOTS; i++) {
+    index->slots[i].key = 0;
+    index->slots[i].hits = 0;
+    index->slots[i].page_num = INVALID_PAGE_NUM;
   }
+  return index;
+}
+
+static void hot_index_invalidate(Table *table) {
+  table->hot_index->generation++;
+}
+
+static HotSlot *hot_index_slot(HotIndex *index, uint32_t key) {
+  return &index->slots[(key * 2654435761u) % HOT_INDEX_SLOTS];
+}
+
+// Record a lookup of key. Returns the slot if the key owns it.
+static HotSlot *hot_index_touch(HotIndex *index, uint32_t key) {
+  HotSlot *slot = hot_index_slot(index, key);
+  if (slot->hits > 0 && slot->key == key) {
+    if (slot->hits < HOT_INDEX_MAX_HITS) {
+      slot->hits++;
+    }
+    return slot;
+  }
+  if (slot->hits > 0) {
+    slot->hits--;
+    return NULL;
+  }
+  slot->key = key;
+  slot->hits = 1;
+  slot->page_num = INVALID_PAGE_NUM;
+  return slot;
+}
+
+Cursor *table_lookup(Table *table, Snapshot *snapshot, uint32_t key, bool use_index) {
+  HotIndex *index = use_index ? table->hot_index : NULL;
+  HotSlot *slot = index ? hot_index_touch(index, key) : NULL;
+
+  if (slot && slot->page_num != INVALID_PAGE_NUM
+      && slot->generation == index->generation) {
+    // Any page a snapshot was taken with is part of its tree, so a leaf
+    // there holding the key is where the snapshot keeps it.
+    uint32_t num_pages = snapshot ? snapshot->num_pages : table->pager->num_pages;
+    if (slot->page_num < num_pages) {
+      void *node = read_page(table, snapshot, slot->page_num);
+      if (get_node_type(node) == NODE_LEAF
+          && slot->cell_num < *leaf_node_num_cells(node)
+          && *leaf_node_key(node, slot->cell_num) == key) {
+        Cursor *c = malloc(sizeof(Cursor));
+        c->table = table;
+        c->snapshot = snapshot;
+        c->page_num = slot->page_num;
+        c->cell_num = slot->cell_num;
+        c->end_of_table = false;
+        return c;
+      }
+    }
+  }
+
+  Cursor *c = table_seek(table, snapshot, key);
+  if (slot && slot->hits >= HOT_INDEX_MIN_HITS && !c->end_of_table) {
+    slot->page_num = c->page_num;
+    slot->cell_num = c->cell_num;
+    slot->generation = index->generation;
+  }
+  return c;
 }
 
 void *cursor_get_slot(Cursor *c) {
-  void *page = get_page(c->table->pager, c->page_num);
+  void *page = read_page(c->table, c->snapshot, c->page_num);
   return leaf_node_value(page, c->cell_num);
 }
 
 void cursor_advance(Cursor *c) {
-  void *node = get_page(c->table->pager, c->page_num);
+  void *node = read_page(c->table, c->snapshot, c->page_num);
   c->cell_num++;
   if (c->cell_num >= (*leaf_node_num_cells(node))) {
     uint32_t next_page_num = *leaf_node_next_leaf(node);
@@ -419,11 +1723,62 @@ void cursor_advance(Cursor *c) {
   }
 }
 
+/* Column filter */
+// match_bytes reads whole blocks past the compared bytes: the pattern is
+// sized to allow it, and each column is followed by enough of its cell.
+_Static_assert(sizeof(((ColumnFilter *)0)->pattern) % MATCH_BLOCK_SIZE == 0,
+               "pattern is not a whole number of blocks");
+
+bool column_filter_init(ColumnFilter *f, Column column, const char *value,
+                        uint32_t len, bool prefix) {
+  uint32_t size;
+  switch (column) {
+  case COLUMN_USERNAME:
+    f->offset = LEAF_NODE_VALUE_OFFSET + USERNAME_OFFSET;
+    size = USERNAME_SIZE;
+    break;
+  case COLUMN_EMAIL:
+    f->offset = LEAF_NODE_VALUE_OFFSET + EMAIL_OFFSET;
+    size = EMAIL_SIZE;
+    break;
+  default:
+    assert(false);
+  }
+  // A stored value is followed by at least one NUL, which an exact match
+  // compares too.
+  f->len = prefix ? len : len + 1;
+  if (f->len > size) {
+    return false;
+  }
+  memset(f->pattern, 0, sizeof(f->pattern));
+  memcpy(f->pattern, value, len);
+  return true;
+}
+
+bool cursor_seek_match(Cursor *c, const ColumnFilter *f) {
+  void *node = read_page(c->table, c->snapshot, c->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  for (; c->cell_num < num_cells; c->cell_num++) {
+    if (match_bytes(leaf_node_cell(node, c->cell_num) + f->offset, f->pattern, f->len)) {
+      return true;
+    }
+  }
+  uint32_t next_page_num = *leaf_node_next_leaf(node);
+  if (next_page_num == 0) {
+    c->end_of_table = true;
+  } else {
+    c->page_num = next_page_num;
+    c->cell_num = 0;
+  }
+  return false;
+}
+
 static void create_new_root(Table *table, uint32_t right_child_page_num) {
-  void *root = get_page(table->pager, table->root_page_num);
-  void *right_child = get_page(table->pager, right_child_page_num);
+  table->stats.root_promotions++;
+  void *root = get_page_for_write(table->pager, table->root_page_num);
+  void *right_child = get_page_for_write(table->pager, right_child_page_num);
   uint32_t left_child_page_num = get_unused_page_num(table->pager);
-  void *left_child = get_page(table->pager, left_child_page_num);
+  void *left_child = get_page_for_write(table->pager, left_child_page_num);
 
   if (get_node_type(root) == NODE_INTERNAL) {
     initialize_internal_node(right_child);
@@ -436,10 +1791,10 @@ static void create_new_root(Table *table, uint32_t right_child_page_num) {
   if (get_node_type(left_child) == NODE_INTERNAL) {
     void *child;
     for (int i=0; i<*internal_node_num_keys(left_child); i++) {
-      child = get_page(table->pager, *internal_node_child(left_child, i));
+      child = get_page_for_write(table->pager, *internal_node_child(left_child, i));
       *node_parent(child) = left_child_page_num;
     }
-    child = get_page(table->pager, *internal_node_right_child(left_child));
+    child = get_page_for_write(table->pager, *internal_node_right_child(left_child));
     *node_parent(child) = left_child_page_num;
   }
 
@@ -456,7 +1811,9 @@ static void create_new_root(Table *table, uint32_t right_child_page_num) {
 
 static void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key) {
   uint32_t old_child_idx = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_idx) = new_key;
+  if (old_child_idx < *internal_node_num_keys(node)) { // the right child has no key
+    *internal_node_key(node, old_child_idx) = new_key;
+  }
 }
 
 static void internal_node_insert(
@@ -470,33 +1827,35 @@ static void internal_node_split_and_insert(
   uint32_t parent_page_num,
   uint32_t child_page_num
 ) {
+  hot_index_invalidate(table);
+  table->stats.internal_splits++;
+
   uint32_t old_page_num = parent_page_num;
-  void *old_node = get_page(table->pager, old_page_num);
+  void *old_node = get_page_for_write(table->pager, old_page_num);
   uint32_t old_max_key = get_node_max_key(table->pager, old_node);
 
-  void *child = get_page(table->pager, child_page_num);
+  void *child = get_page_for_write(table->pager, child_page_num);
   uint32_t child_max_key = get_node_max_key(table->pager, child);
 
   uint32_t new_page_num = get_unused_page_num(table->pager);
 
   bool splitting_root = is_root_node(old_node);
 
-  void *parent, *new_node;
+  void *parent;
   if (splitting_root) {
     create_new_root(table, new_page_num);
-    parent = get_page(table->pager, table->root_page_num);
+    parent = get_page_for_write(table->pager, table->root_page_num);
     old_page_num = *internal_node_child(parent, 0);
-    old_node = get_page(table->pager, old_page_num);
+    old_node = get_page_for_write(table->pager, old_page_num);
   } else {
-    parent = get_page(table->pager, *node_parent(old_node));
-    new_node = get_page(table->pager, new_page_num);
-    initialize_internal_node(new_node);
+    parent = get_page_for_write(table->pager, *node_parent(old_node));
+    initialize_internal_node(get_page_for_write(table->pager, new_page_num));
   }
 
   uint32_t *old_num_keys = internal_node_num_keys(old_node);
 
   uint32_t cur_page_num = *internal_node_right_child(old_node);
-  void *cur = get_page(table->pager, cur_page_num);
+  void *cur = get_page_for_write(table->pager, cur_page_num);
 
   // right child to new node
   internal_node_insert(table, new_page_num, cur_page_num);
@@ -506,7 +1865,7 @@ static void internal_node_split_and_insert(
   // move left over child to new node
   for (int i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS/2; i--) {
     cur_page_num = *internal_node_child(old_node, i);
-    cur = get_page(table->pager, cur_page_num);
+    cur = get_page_for_write(table->pager, cur_page_num);
 
     internal_node_insert(table, new_page_num, cur_page_num);
     *node_parent(cur) = new_page_num;
@@ -527,8 +1886,10 @@ static void internal_node_split_and_insert(
   update_internal_node_key(parent, old_max_key, old_max_key_after_split);
 
   if (!splitting_root) {
-    internal_node_insert(table, *node_parent(old_node), new_page_num);
+    // Set before inserting: a split of the parent may move new_node.
+    void *new_node = get_page_for_write(table->pager, new_page_num);
     *node_parent(new_node) = *node_parent(old_node);
+    internal_node_insert(table, *node_parent(old_node), new_page_num);
   }
 }
 
@@ -537,7 +1898,7 @@ static void internal_node_insert(
   uint32_t parent_page_num,
   uint32_t child_page_num
 ) {
-  void *parent = get_page(table->pager, parent_page_num);
+  void *parent = get_page_for_write(table->pager, parent_page_num);
   void *child = get_page(table->pager, child_page_num);
   uint32_t child_max_key = get_node_max_key(table->pager, child);
   uint32_t idx = internal_node_find_child(parent, child_max_key);
@@ -575,11 +1936,14 @@ static void internal_node_insert(
 }
 
 static void leaf_node_split_and_insert(Cursor *c, uint32_t key, Row *value) {
+  hot_index_invalidate(c->table);
+  c->table->stats.leaf_splits++;
+
   /* Create a new node */
-  void *old_node = get_page(c->table->pager, c->page_num);
+  void *old_node = get_page_for_write(c->table->pager, c->page_num);
   uint32_t old_max_key = get_node_max_key(c->table->pager, old_node);
   uint32_t new_page_num = get_unused_page_num(c->table->pager);
-  void *new_node = get_page(c->table->pager, new_page_num);
+  void *new_node = get_page_for_write(c->table->pager, new_page_num);
   initialize_leaf_node(new_node);
   *node_parent(new_node) = *node_parent(old_node);
   *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
@@ -609,19 +1973,21 @@ static void leaf_node_split_and_insert(Cursor *c, uint32_t key, Row *value) {
   } else {
     uint32_t parent_page_num = *node_parent(old_node);
     uint32_t new_max_key = get_node_max_key(c->table->pager, old_node);
-    void *parent = get_page(c->table->pager, parent_page_num);
+    void *parent = get_page_for_write(c->table->pager, parent_page_num);
     update_internal_node_key(parent, old_max_key, new_max_key);
     internal_node_insert(c->table, parent_page_num, new_page_num);
   }
 }
 
 void leaf_node_insert(Cursor *c, uint32_t key, Row *value) {
-  void *node = get_page(c->table->pager, c->page_num);
+  uint64_t start = phase_begin();
+  void *node = get_page_for_write(c->table->pager, c->page_num);
 
   uint32_t num_cells = *leaf_node_num_cells(node);
   if (num_cells >= LEAF_NODE_MAX_CELLS) {
     // Node is full
     leaf_node_split_and_insert(c, key, value);
+    phase_end(PHASE_SPLIT, start);
     return;
   }
 
@@ -636,37 +2002,217 @@ void leaf_node_insert(Cursor *c, uint32_t key, Row *value) {
   *(leaf_node_num_cells(node)) += 1;
   *(leaf_node_key(node, c->cell_num)) = key;
   serialize_row(value, leaf_node_value(node, c->cell_num));
+  phase_end(PHASE_LEAF_INSERT, start);
+}
+
+// The leaf a search for key ends in, like table_find. Keys up to *upper
+// belong in that leaf too.
+static uint32_t table_find_leaf(Table *table, uint32_t key, uint32_t *upper) {
+  uint64_t start = phase_begin();
+  uint32_t page_num = table->root_page_num;
+  void *node = get_page(table->pager, page_num);
+  table->stats.descents++;
+  table->stats.descent_nodes++;
+
+  *upper = UINT32_MAX;
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_idx = internal_node_find_child(node, key);
+    if (child_idx < *internal_node_num_keys(node)) {
+      *upper = *internal_node_key(node, child_idx);
+    }
+    page_num = *internal_node_child(node, child_idx);
+    node = get_page(table->pager, page_num);
+    table->stats.descent_nodes++;
+  }
+  phase_end(PHASE_DESCENT, start);
+  return page_num;
+}
+
+static void leaf_node_set_row(void *node, uint32_t cell_num, Row *row) {
+  *leaf_node_key(node, cell_num) = row->id;
+  serialize_row(row, leaf_node_value(node, cell_num));
+}
+
+/*
+ * Inserts rows, sorted and new, that all belong in leaf page_num. When
+ * they do not fit, the leaf is split once, into as many evenly filled
+ * leaves as the merged cells need, instead of once per row.
+ */
+static void leaf_node_insert_run(Table *table, uint32_t page_num, Row *rows, uint32_t num_rows) {
+  uint64_t start = phase_begin();
+  void *node = get_page_for_write(table->pager, page_num);
+  uint32_t num_old = *leaf_node_num_cells(node);
+  uint32_t total = num_old + num_rows;
+
+  if (total <= LEAF_NODE_MAX_CELLS) {
+    // Merge from the back, so each cell moves at most once.
+    uint32_t i = num_old, j = num_rows;
+    for (uint32_t cell = total; j > 0; cell--) {
+      if (i > 0 && *leaf_node_key(node, i - 1) > rows[j - 1].id) {
+        memcpy(leaf_node_cell(node, cell - 1), leaf_node_cell(node, i - 1),
+            LEAF_NODE_CELL_SIZE);
+        i--;
+      } else {
+        leaf_node_set_row(node, cell - 1, &rows[--j]);
+      }
+    }
+    *leaf_node_num_cells(node) = total;
+    phase_end(PHASE_LEAF_INSERT, start);
+    return;
+  }
+
+  hot_index_invalidate(table);
+  table->stats.leaf_splits++;
+  void *old = copy_page(node);
+  uint32_t old_max_key = num_old > 0 ? *leaf_node_key(old, num_old - 1) : 0;
+  bool splitting_root = is_root_node(old);
+
+  uint32_t num_leaves = (total + LEAF_NODE_MAX_CELLS - 1) / LEAF_NODE_MAX_CELLS;
+  uint32_t *leaf_pages = malloc(num_leaves * sizeof(uint32_t));
+  if (!leaf_pages) die("malloc");
+  uint32_t i = 0, j = 0;
+  for (uint32_t leaf = 0; leaf < num_leaves; leaf++) {
+    leaf_pages[leaf] = leaf == 0 ? page_num : get_unused_page_num(table->pager);
+    void *leaf_node = get_page_for_write(table->pager, leaf_pages[leaf]);
+    if (leaf > 0) {
+      void *prev = get_page_for_write(table->pager, leaf_pages[leaf - 1]);
+      initialize_leaf_node(leaf_node);
+      *leaf_node_next_leaf(leaf_node) = *leaf_node_next_leaf(prev);
+      *leaf_node_next_leaf(prev) = leaf_pages[leaf];
+    }
+
+    uint32_t count = total / num_leaves + (leaf < total % num_leaves);
+    for (uint32_t cell = 0; cell < count; cell++) {
+      if (j == num_rows || (i < num_old && *leaf_node_key(old, i) < rows[j].id)) {
+        memcpy(leaf_node_cell(leaf_node, cell), leaf_node_cell(old, i++),
+            LEAF_NODE_CELL_SIZE);
+      } else {
+        leaf_node_set_row(leaf_node, cell, &rows[j++]);
+      }
+    }
+    *leaf_node_num_cells(leaf_node) = count;
+  }
+
+  // Link the new leaves into the tree as leaf_node_split_and_insert does,
+  // from the last one back. The last takes over the old leaf's max key, and
+  // each earlier one goes just left of the one after it, wherever splits
+  // above moved that. So every max key a split reads is already final.
+  for (uint32_t leaf = num_leaves - 1; leaf > 0; leaf--) {
+    uint32_t parent_page_num;
+    if (leaf < num_leaves - 1) {
+      parent_page_num = *node_parent(get_page(table->pager, leaf_pages[leaf + 1]));
+    } else if (splitting_root) {
+      create_new_root(table, leaf_pages[leaf]);
+      pager_unpin_all(table->pager);
+      continue;
+    } else {
+      void *first = get_page(table->pager, page_num);
+      parent_page_num = *node_parent(first);
+      void *parent = get_page_for_write(table->pager, parent_page_num);
+      update_internal_node_key(parent, old_max_key, get_node_max_key(table->pager, first));
+    }
+    *node_parent(get_page_for_write(table->pager, leaf_pages[leaf])) = parent_page_num;
+    internal_node_insert(table, parent_page_num, leaf_pages[leaf]);
+    pager_unpin_all(table->pager); // only page numbers are kept across leaves
+  }
+  free(leaf_pages);
+  free(old);
+  phase_end(PHASE_SPLIT, start);
+}
+
+// The rows of a batch that go into one leaf end before rows[end].
+typedef struct {
+  uint32_t page_num;
+  uint32_t end;
+} LeafRun;
+
+/*
+ * Splits sorted rows into runs that belong in the same leaf, one descent
+ * per run. Returns NULL if an id is already in the table or repeated.
+ * Splitting one of the leaves leaves the others and their key ranges as
+ * they were, so the runs stay valid while they are inserted in order.
+ */
+static LeafRun *table_plan_runs(Table *table, Row *rows, uint32_t num_rows,
+                                uint32_t *num_runs) {
+  LeafRun *runs = NULL;
+  uint32_t cap = 0;
+  *num_runs = 0;
+  uint32_t done = 0;
+  while (done < num_rows) {
+    uint32_t upper;
+    uint32_t page_num = table_find_leaf(table, rows[done].id, &upper);
+    void *node = get_page(table->pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t cell = 0;
+    for (; done < num_rows && rows[done].id <= upper; done++) {
+      uint32_t key = rows[done].id;
+      while (cell < num_cells && *leaf_node_key(node, cell) < key) {
+        cell++;
+      }
+      if ((cell < num_cells && *leaf_node_key(node, cell) == key)
+          || (done > 0 && rows[done - 1].id == key)) {
+        pager_unpin_all(table->pager);
+        free(runs);
+        return NULL;
+      }
+    }
+    pager_unpin_all(table->pager);
+
+    if (*num_runs == cap) {
+      cap = cap ? cap * 2 : 4;
+      runs = realloc(runs, cap * sizeof(LeafRun));
+      if (!runs) die("realloc");
+    }
+    runs[(*num_runs)++] = (LeafRun){page_num, done};
+  }
+  return runs;
+}
+
+bool table_insert_sorted(Table *table, Row *rows, uint32_t num_rows) {
+  uint32_t num_runs;
+  LeafRun *runs = table_plan_runs(table, rows, num_rows, &num_runs);
+  if (runs == NULL && num_rows > 0) {
+    return false;
+  }
+  uint32_t done = 0;
+  for (uint32_t i = 0; i < num_runs; i++) {
+    leaf_node_insert_run(table, runs[i].page_num, rows + done, runs[i].end - done);
+    done = runs[i].end;
+    pager_unpin_all(table->pager);
+  }
+  free(runs);
+  return true;
 }
 
-void print_constants(void) {
-  printf("ROW_SIZE: %d\n", ROW_SIZE);
-  printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-  printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-  printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-  printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+void print_constants(FILE *out) {
+  fprintf(out, "ROW_SIZE: %d\n", ROW_SIZE);
+  fprintf(out, "COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+  fprintf(out, "LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+  fprintf(out, "LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+  fprintf(out, "LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+  fprintf(out, "LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
 }
 
-void print_tree(Pager *p, uint32_t page_num, uint32_t depth) {
-  void *node = get_page(p, page_num);
+void print_tree(FILE *out, Table *table, Snapshot *snapshot, uint32_t page_num, uint32_t depth) {
+  void *node = read_page(table, snapshot, page_num);
   uint32_t num_keys, child;
 
   switch (get_node_type(node)) {
   case NODE_LEAF:
     num_keys = *leaf_node_num_cells(node);
-    printf("%*s leaf (size %d)\n", depth*2+1, "-", num_keys);
+    fprintf(out, "%*s leaf (size %d)\n", depth*2+1, "-", num_keys);
     for (uint32_t i=0; i<num_keys; i++) {
-      printf("%*s %d\n", (depth+1)*2+1, "-", *leaf_node_key(node, i));
+      fprintf(out, "%*s %d\n", (depth+1)*2+1, "-", *leaf_node_key(node, i));
     }
     break;
   case NODE_INTERNAL:
     num_keys = *internal_node_num_keys(node);
-    printf("%*s internal (size %d)\n", depth*2+1, "-", num_keys);
+    fprintf(out, "%*s internal (size %d)\n", depth*2+1, "-", num_keys);
     if (num_keys > 0) {
       for (uint32_t i=0; i<num_keys; i++) {
         child = *internal_node_child(node, i);
-        print_tree(p, child, depth+1);
-        printf("%*s key %d\n", depth*2+1, "-", *internal_node_key(node, i));
+        print_tree(out, table, snapshot, child, depth+1);
+        fprintf(out, "%*s key %d\n", depth*2+1, "-", *internal_node_key(node, i));
       }
     }
     break;
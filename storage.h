@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 /* Row */
 #define COLUMN_USERNAME_SIZE 32
@@ -13,43 +14,128 @@ typedef struct {
   char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
 
-void print_row(Row *row);
+void print_row(FILE *out, Row *row);
 void serialize_row(Row *src, void *dest);
 void deserialize_row(void *src, Row *dest);
 
 /* Pager */
 typedef struct Pager_tag Pager;
 void *get_page(Pager *p, uint32_t page_num);
+// Pages returned by get_page stay in memory until this is called, after
+// which they may be evicted. Call it only when no page pointers are held.
+void pager_unpin_all(Pager *p);
+
+// Counters are totals since open; the last four are current values.
+typedef struct {
+  uint64_t hits;          // get_page answered from the buffer pool
+  uint64_t misses;        // get_page that had to load the page
+  uint64_t pages_read;    // pages loaded from the database file
+  uint64_t pages_written; // pages stored to the database file
+  uint64_t flushes;       // dirty frames written back by pager_flush
+  uint64_t bytes_read;    // database and WAL file bytes
+  uint64_t bytes_written;
+  uint32_t cached_pages;
+  uint32_t cache_capacity;
+  uint32_t file_pages;
+  uint32_t shadow_pages; // page images kept for open snapshots
+} PagerStats;
+PagerStats pager_stats(Pager *p);
 
 /* Table */
 extern const uint32_t TABLE_MAX_ROWS;
 
+typedef struct HotIndex_tag HotIndex;
+
+typedef struct {
+  uint64_t leaf_splits;
+  uint64_t internal_splits;
+  uint64_t root_promotions; // the tree grew a level
+  uint64_t descents;        // root to leaf searches
+  uint64_t descent_nodes;   // nodes visited by those searches
+} TreeStats;
+
 typedef struct {
   uint32_t root_page_num;
   Pager *pager;
+  HotIndex *hot_index;
+  TreeStats stats;
 } Table;
 
-Table *db_open(const char *filename);
+// compress only applies when the file is created; an existing file keeps
+// the format it was created with.
+Table *db_open(const char *filename, bool compress);
 void db_close(Table *table);
 
+// Changes made between db_begin and db_commit reach the file atomically,
+// with a single fsync. Closing the table rolls back an open transaction.
+bool db_in_transaction(Table *table);
+void db_begin(Table *table);
+void db_commit(Table *table);
+void db_rollback(Table *table);
+// Writes a copy of the table as committed to path, replacing any file
+// there only once the copy is durable. Not while a transaction is open.
+// Returns false with errno set if the copy could not be made.
+bool db_backup(Table *table, const char *path);
+
+/* Snapshot */
+// A read-only view of the table as last committed. Writes made while it is
+// open copy the pages it reads, so it never blocks them.
+typedef struct Snapshot_tag Snapshot;
+Snapshot *db_snapshot(Table *table);
+void snapshot_release(Snapshot *snap);
+// Number of levels from the root to the leaves, as seen by snapshot.
+uint32_t table_height(Table *table, Snapshot *snapshot);
+
 /* Cursor */
 typedef struct {
   Table *table;
+  Snapshot *snapshot; // NULL reads the latest pages
   uint32_t page_num;
   uint32_t cell_num;
   bool end_of_table;
 } Cursor;
 
-Cursor *table_start(Table *table);
+Cursor *table_start(Table *table, Snapshot *snapshot);
 Cursor *table_find(Table *table, uint32_t key);
+// Like table_find, but answers keys that are looked up often from an
+// in-memory hash index instead of descending the tree. Without use_index
+// it neither reads nor updates the index.
+Cursor *table_lookup(Table *table, Snapshot *snapshot, uint32_t key, bool use_index);
 void *cursor_get_slot(Cursor *c);
 void cursor_advance(Cursor *c);
 
+/* Column filter */
+typedef enum {
+  COLUMN_USERNAME,
+  COLUMN_EMAIL,
+} Column;
+
+// A text column equal to a value, or starting with a prefix. It is tested
+// on the bytes stored in the leaf, so rows that fail are never copied out.
+typedef struct {
+  uint32_t offset; // of the column in a leaf cell
+  uint32_t len;    // bytes compared, including the NUL unless a prefix
+  char pattern[COLUMN_EMAIL_SIZE + 1];
+} ColumnFilter;
+
+// Returns false if no row can pass, because value is longer than the column.
+bool column_filter_init(ColumnFilter *f, Column column, const char *value,
+                        uint32_t len, bool prefix);
+// Moves c to the first row that passes f, from the one it is on to the
+// end of its leaf. If none does, returns false with c at the start of the
+// next leaf, or at the end of the table.
+bool cursor_seek_match(Cursor *c, const ColumnFilter *f);
+
 /* Node */
 extern const uint32_t LEAF_NODE_MAX_CELLS;
 void leaf_node_insert(Cursor *c, uint32_t key, Row *value);
+// Inserts rows sorted by id. Rows that land in the same leaf share one
+// descent, and a leaf is split at most once. Inserts nothing and returns
+// false if an id is already taken or repeated. Like pager_unpin_all, call
+// it only when no page pointers are held.
+bool table_insert_sorted(Table *table, Row *rows, uint32_t num_rows);
 uint32_t *leaf_node_num_cells(void *node);
 uint32_t *leaf_node_key(void *node, uint32_t cell_num);
 
-void print_constants(void);
-void print_tree(Pager *p, uint32_t page_num, uint32_t depth);
+void print_constants(FILE *out);
+void print_tree(FILE *out, Table *table, Snapshot *snapshot, uint32_t page_num, uint32_t depth);
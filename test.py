@@ -1,5 +1,11 @@
+import json
 import os
+import shutil
+import signal
+import socket
+import struct
 import subprocess
+import time
 from unittest import TestCase
 
 
@@ -8,12 +14,15 @@ class DBTest(TestCase):
 
     def tearDown(self):
         os.remove(self.TEST_DB)
+        for path in [self.TEST_DB + "-wal", self.TEST_DB + ".orig"]:
+            if os.path.exists(path):
+                os.remove(path)
 
-    def run_commands(self, commands: list[str]) -> list[str]:
+    def run_commands(self, commands: list[str], args: list[str] = []) -> list[str]:
         input_data = "\n".join(commands) + "\n"
 
         p = subprocess.Popen(
-            ["./db", self.TEST_DB],
+            ["./db", *args, self.TEST_DB],
             stdin=subprocess.PIPE,
             stdout=subprocess.PIPE,
             stderr=subprocess.PIPE,
@@ -28,6 +37,15 @@ class DBTest(TestCase):
 
         return stdout.split("\n")
 
+    def wal_ends_with_commit(self, path: str) -> bool:
+        if not os.path.exists(path):
+            return False
+        with open(path, "rb") as f:
+            data = f.read()
+        if len(data) < 16 or (len(data) - 16) % (16 + 4096) != 0:
+            return False
+        return data[-16:-12] == b"\xff\xff\xff\xff"
+
     def test_normal_insert_and_select(self):
         commands = [
             "insert 1 user1 person1@example.com",
@@ -43,16 +61,57 @@ class DBTest(TestCase):
         got = self.run_commands(commands)
         self.assertEqual(got, want)
 
-    def test_error_when_table_is_full(self):
+    def test_table_larger_than_page_cache(self):
         commands = [
             f"insert {i} user{i} person{i}@example.com"
             for i in range(6002)
         ]
+        commands.append("select")
         commands.append(".exit")
-        want = "db> Error: Table full."
 
         got = self.run_commands(commands)
-        self.assertEqual(got[-2], want)
+        self.assertEqual(got[6002], "db> (0, user0, person0@example.com)")
+        self.assertEqual(got[-3], "(6001, user6001, person6001@example.com)")
+        self.assertEqual(got[-2], "Executed.")
+
+    def test_compressed_file(self):
+        commands = [
+            f"insert {i} user{i} person{i}@example.com"
+            for i in range(1000)
+        ]
+        commands.append(".exit")
+        self.run_commands(commands)
+        plain_size = os.path.getsize(self.TEST_DB)
+        os.remove(self.TEST_DB)
+        self.run_commands(commands, ["--compress"])
+        self.assertLess(os.path.getsize(self.TEST_DB), plain_size / 3)
+
+        # The file remembers its format.
+        got = self.run_commands(["insert 1000 a b", "select", ".exit"])
+        self.assertEqual(got[1], "db> (0, user0, person0@example.com)")
+        self.assertEqual(got[1000], "(999, user999, person999@example.com)")
+        self.assertEqual(got[1001], "(1000, a, b)")
+
+    def test_pages_beyond_4gb(self):
+        self.run_commands([
+            "insert 0 user0 person0@example.com",
+            ".exit",
+        ])
+        # Sparse file: no blocks are allocated for the hole.
+        size = 5 * 1024**3
+        os.truncate(self.TEST_DB, size)
+
+        # Overflowing the root leaf allocates pages past the 4 GiB mark.
+        self.run_commands([
+            f"insert {i} user{i} person{i}@example.com"
+            for i in range(1, 14)
+        ] + [".exit"])
+        self.assertGreater(os.path.getsize(self.TEST_DB), size)
+
+        got = self.run_commands(["select", ".exit"])
+        self.assertEqual(got[0], "db> (0, user0, person0@example.com)")
+        self.assertEqual(got[13], "(13, user13, person13@example.com)")
+        self.assertEqual(got[14], "Executed.")
 
     def test_insert_max_len_string(self):
         long_username = "u" * 32
@@ -135,3 +194,641 @@ class DBTest(TestCase):
             ".exit",
         ])
         self.assertEqual(got, want)
+
+    def test_rollback_discards_changes(self):
+        commands = [
+            "insert 1 user1 person1@example.com",
+            "begin",
+        ]
+        commands += [
+            f"insert {i} user{i} person{i}@example.com"
+            for i in range(2, 40)
+        ]
+        commands += [
+            "rollback",
+            "select",
+            ".btree",
+            ".exit",
+        ]
+        want = [
+            "db> (1, user1, person1@example.com)",
+            "Executed.",
+            "db> Tree:",
+            "- leaf (size 1)",
+            "  - 1",
+            "db> ",
+        ]
+        got = self.run_commands(commands)
+        self.assertEqual(got[-7], "db> Executed.")
+        self.assertEqual(got[-6:], want)
+
+    def test_transaction_errors(self):
+        got = self.run_commands([
+            "commit",
+            "begin",
+            "begin",
+            "rollback",
+            "rollback",
+            ".exit",
+        ])
+        want = [
+            "db> Error: No transaction is active.",
+            "db> Executed.",
+            "db> Error: Transaction already active.",
+            "db> Executed.",
+            "db> Error: No transaction is active.",
+            "db> ",
+        ]
+        self.assertEqual(got, want)
+
+    def test_exit_rolls_back_open_transaction(self):
+        self.run_commands([
+            "insert 1 user1 person1@example.com",
+            "begin",
+            "insert 2 user2 person2@example.com",
+            ".exit",
+        ])
+        got = self.run_commands(["select", ".exit"])
+        self.assertEqual(got, [
+            "db> (1, user1, person1@example.com)",
+            "Executed.",
+            "db> ",
+        ])
+
+    def crash_after_commit(self):
+        # Commits rows 2..29 after row 1, then loses every write that
+        # reached the db file after the commit. Only the WAL has them.
+        self.run_commands([
+            "insert 1 user1 person1@example.com",
+            ".exit",
+        ])
+        shutil.copy(self.TEST_DB, self.TEST_DB + ".orig")
+
+        p = subprocess.Popen(
+            ["./db", self.TEST_DB],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.DEVNULL,
+            stderr=subprocess.DEVNULL,
+            text=True,
+        )
+        commands = ["begin"]
+        commands += [
+            f"insert {i} user{i} person{i}@example.com"
+            for i in range(2, 30)
+        ]
+        commands.append("commit")
+        p.stdin.write("\n".join(commands) + "\n")
+        p.stdin.flush()
+        # The transaction is committed once its commit record, a page
+        # number of 0xffffffff, ends the WAL.
+        wal = self.TEST_DB + "-wal"
+        deadline = time.monotonic() + 10
+        while not self.wal_ends_with_commit(wal):
+            if time.monotonic() > deadline:
+                p.kill()
+                p.wait()
+                self.fail("the transaction was not committed to the WAL")
+            time.sleep(0.01)
+        p.send_signal(signal.SIGKILL)
+        p.wait()
+        p.stdin.close()
+
+        shutil.copy(self.TEST_DB + ".orig", self.TEST_DB)
+
+    def test_recover_committed_transaction_from_wal(self):
+        self.crash_after_commit()
+
+        got = self.run_commands(["select", ".exit"])
+        self.assertEqual(got[0], "db> (1, user1, person1@example.com)")
+        self.assertEqual(got[28], "(29, user29, person29@example.com)")
+        self.assertEqual(got[29], "Executed.")
+        self.assertFalse(os.path.exists(self.TEST_DB + "-wal"))
+
+    def test_recover_ignores_corrupt_commit_record(self):
+        self.crash_after_commit()
+        # The page count follows the commit record's page number.
+        with open(self.TEST_DB + "-wal", "r+b") as f:
+            f.seek(-12, os.SEEK_END)
+            f.write(struct.pack("<I", 1000))
+
+        got = self.run_commands(["select", ".exit"])
+        self.assertEqual(got, [
+            "db> (1, user1, person1@example.com)",
+            "Executed.",
+            "db> ",
+        ])
+        self.assertEqual(os.path.getsize(self.TEST_DB), 4096)
+
+    def test_select_by_id(self):
+        commands = [
+            f"insert {i} user{i} person{i}@example.com"
+            for i in range(1, 100)
+        ]
+        # Repeated lookups make the keys hot; the inserts in between split
+        # the leaves they were found in.
+        for i in range(100, 110):
+            commands += [
+                "select where id = 7",
+                "select where id = 50",
+                f"insert {i} user{i} person{i}@example.com",
+            ]
+        commands += [
+            ".hotindex off",
+            "select where id = 50",
+            "select where id = 1000",
+            "select where id = foo",
+            ".exit",
+        ]
+        got = self.run_commands(commands)
+        self.assertEqual(got[99:103], [
+            "db> (7, user7, person7@example.com)",
+            "Executed.",
+            "db> (50, user50, person50@example.com)",
+            "Executed.",
+        ])
+        self.assertEqual(got[-10:-6], [
+            "db> (7, user7, person7@example.com)",
+            "Executed.",
+            "db> (50, user50, person50@example.com)",
+            "Executed.",
+        ])
+        self.assertEqual(got[-5:], [
+            "db> db> (50, user50, person50@example.com)",
+            "Executed.",
+            "db> Executed.",
+            "db> Syntax error. Could not parse statement 'select where id = foo'",
+            "db> ",
+        ])
+
+    def test_stats(self):
+        commands = [
+            f"insert {i} user{i} person{i}@example.com"
+            for i in range(1, 31)
+        ]
+        commands += [".stats", ".stats json", ".exit"]
+        got = self.run_commands(commands)
+        self.assertEqual(got[30], "db> Stats:")
+        self.assertIn("root_promotions: 1", got)
+        stats = json.loads(got[-2].removeprefix("db> "))
+        self.assertEqual(stats["leaf_splits"], 3)
+        self.assertEqual(stats["root_promotions"], 1)
+        self.assertEqual(stats["tree_height"], 2)
+        self.assertEqual(stats["descents"], 30)
+        self.assertGreater(stats["cache_hits"], 0)
+        # Reporting the tree height does not count as cache use.
+        self.assertIn(f"cache_hits: {stats['cache_hits']}", got)
+
+    def test_timer_and_profile(self):
+        commands = [".timer on", ".profile on"]
+        commands += [
+            f"insert {i} user{i} person{i}@example.com"
+            for i in range(1, 31)
+        ]
+        commands += [".timer off", "select", ".profile", ".exit"]
+        got = self.run_commands(commands)
+        self.assertEqual(got[0], "db> db> db> Executed.")
+        self.assertRegex(got[1], r"^Time: parse \d+\.\d{3} ms, execute \d+\.\d{3} ms$")
+        self.assertNotRegex("\n".join(got[62:]), r"Time: ")
+
+        profile = got[got.index("db> Profile (ns):") + 2:-1]
+        rows = {tuple(line.split()[:3]) for line in profile}
+        self.assertIn(("insert", "parse", "30"), rows)
+        self.assertIn(("insert", "execute", "30"), rows)
+        self.assertIn(("insert", "descent", "30"), rows)
+        self.assertIn(("insert", "split", "3"), rows)
+        self.assertIn(("insert", "leaf_insert", "27"), rows)
+        self.assertIn(("select", "execute", "1"), rows)
+
+    SOCK_PATH = "test.sock"
+
+    def start_server(self) -> subprocess.Popen:
+        server = subprocess.Popen(
+            ["./db", "--serve", self.SOCK_PATH, self.TEST_DB],
+            stderr=subprocess.DEVNULL,
+        )
+        for _ in range(500):
+            if os.path.exists(self.SOCK_PATH):
+                break
+            time.sleep(0.01)
+        return server
+
+    def connect(self) -> socket.socket:
+        # The socket file appears at bind, just before the server listens.
+        for _ in range(100):
+            s = socket.socket(socket.AF_UNIX)
+            try:
+                s.connect(self.SOCK_PATH)
+                return s
+            except ConnectionRefusedError:
+                s.close()
+                time.sleep(0.01)
+        s = socket.socket(socket.AF_UNIX)
+        s.connect(self.SOCK_PATH)
+        return s
+
+    def responses(self, s: socket.socket, n: int) -> list[str]:
+        # Each response ends with an empty line.
+        buf = b""
+        while buf.count(b"\n\n") < n:
+            data = s.recv(65536)
+            if not data:
+                break
+            buf += data
+        return buf.decode().split("\n\n")[:n]
+
+    def test_serve(self):
+        sock_path = self.SOCK_PATH
+        server = self.start_server()
+        try:
+            connect, responses = self.connect, self.responses
+            a, b = connect(), connect()
+            a.sendall(b"insert 1 a a@x\nbegin\ninsert 2 b b@x\n")
+            self.assertEqual(responses(a, 3), ["Executed."] * 3)
+
+            # b reads its snapshot, and its insert waits for a's commit.
+            b.sendall(b"select\ninsert 3 c c@x\nselect\n")
+            self.assertEqual(responses(b, 1), ["(1, a, a@x)\nExecuted."])
+            a.sendall(b"commit\n")
+            self.assertEqual(responses(a, 1), ["Executed."])
+            self.assertEqual(responses(b, 2), [
+                "Executed.",
+                "(1, a, a@x)\n(2, b, b@x)\n(3, c, c@x)\nExecuted.",
+            ])
+
+            # Disconnecting rolls back the session's transaction. Before
+            # that, b still reads the committed tree, though a's rows split
+            # the root leaf.
+            values = ", ".join(f"({i}, 'u', 'u@x')" for i in range(100, 130))
+            a.sendall(f"begin\ninsert 4 d d@x\ninsert values {values}\n".encode())
+            self.assertEqual(responses(a, 3), ["Executed."] * 3)
+            b.sendall(b"select\nselect where id = 110\n")
+            self.assertEqual(responses(b, 2), [
+                "(1, a, a@x)\n(2, b, b@x)\n(3, c, c@x)\nExecuted.",
+                "Executed.",
+            ])
+            a.close()
+            b.sendall(b"insert 5 e e@x\nselect where id = 4\n.exit\n")
+            self.assertEqual(responses(b, 2), ["Executed.", "Executed."])
+            self.assertEqual(b.recv(1), b"")
+            b.close()
+        finally:
+            server.terminate()
+            server.wait()
+        self.assertFalse(os.path.exists(sock_path))
+
+    def test_serve_scan_across_writes(self):
+        # Long values, so that b's select has more output than the server
+        # buffers: its scan stops partway until b reads.
+        name, email = "u" * 32, "e" * 250
+        evens = range(2, 16001, 2)
+        values = ", ".join(f"({i}, '{name}', '{email}')" for i in evens)
+        self.run_commands([f"insert values {values}", ".exit"])
+
+        server = self.start_server()
+        try:
+            a, b = self.connect(), self.connect()
+            b.sendall(b"select\n")
+            # Every leaf b's scan has left, is on, or has yet to reach splits.
+            odds = ", ".join(f"({i}, 'o', 'o@x')" for i in range(1, 16000, 2))
+            a.sendall(f"insert values {odds}\nselect where id = 7\n.stats json\n".encode())
+            got = self.responses(a, 3)
+            self.assertEqual(got[:2], ["Executed.", "(7, o, o@x)\nExecuted."])
+            # The pages b's scan still reads were copied before they changed.
+            self.assertGreater(json.loads(got[2])["shadow_pages"], 0)
+
+            rows = [f"({i}, {name}, {email})" for i in evens]
+            self.assertEqual(self.responses(b, 1), ["\n".join(rows + ["Executed."])])
+            # Released with the scan's snapshot.
+            a.sendall(b".stats json\n")
+            self.assertEqual(json.loads(self.responses(a, 1)[0])["shadow_pages"], 0)
+            b.sendall(b"select where username = 'o' limit 2\n")
+            self.assertEqual(self.responses(b, 1), ["(1, o, o@x)\n(3, o, o@x)\nExecuted."])
+            a.close()
+            b.close()
+        finally:
+            server.terminate()
+            server.wait()
+
+    def test_serve_sorted_output_waits_for_reader(self):
+        # About 9 MB of sorted rows, for a client that does not read them.
+        rows = [(i, f"u{i % 97}", "e" * 250) for i in range(1, 30001)]
+        values = ", ".join(f"({i}, '{u}', '{e}')" for i, u, e in rows)
+        self.run_commands([f"insert values {values}", ".exit"])
+
+        server = self.start_server()
+        def rss_kib():
+            with open(f"/proc/{server.pid}/status") as f:
+                return int(next(l for l in f if l.startswith("VmRSS:")).split()[1])
+        try:
+            b = self.connect()
+            b.sendall(b".sort_memory 64\nselect where id = 1\n")
+            self.responses(b, 1)
+            before = rss_kib()
+            b.sendall(b"select order by username\n")
+            time.sleep(0.5)
+            # The server holds back the rows it cannot send yet.
+            self.assertLess(rss_kib() - before, 4096)
+            got = self.responses(b, 1)[0].split("\n")
+            by_username = sorted(rows, key=lambda r: (r[1], r[0]))
+            self.assertEqual(got, [f"({i}, {u}, {e})" for i, u, e in by_username] + ["Executed."])
+            b.close()
+        finally:
+            server.terminate()
+            server.wait()
+
+    def test_serve_session_settings(self):
+        server = self.start_server()
+        try:
+            a, b = self.connect(), self.connect()
+            # The two settings print nothing but their blank lines.
+            a.sendall(b".timer on\n.sort_memory 1\n.sort_memory\n")
+            self.assertEqual(self.responses(a, 2), ["", "Sort memory: 1 KiB"])
+            values = ", ".join(f"({i}, 'u', 'u@x')" for i in range(2, 22))
+            a.sendall(f"insert 1 a a@x\nbegin\ninsert values {values}\n.stats json\n".encode())
+            got = self.responses(a, 4)
+            for r in got[:3]:
+                self.assertRegex(r, r"^Executed.\nTime: ")
+            self.assertEqual(json.loads(got[3])["tree_height"], 2)
+
+            # b has its own settings, and its meta commands read the
+            # committed tree, as its selects do.
+            b.sendall(b".btree\n.stats json\nselect\n.sort_memory\n")
+            got = self.responses(b, 4)
+            self.assertEqual(got[0], "Tree:\n- leaf (size 1)\n  - 1")
+            self.assertEqual(json.loads(got[1])["tree_height"], 1)
+            self.assertEqual(got[2:], ["(1, a, a@x)\nExecuted.", "Sort memory: 65536 KiB"])
+            a.close()
+            b.close()
+        finally:
+            server.terminate()
+            server.wait()
+
+    def test_multi_row_insert_and_where(self):
+        values = ", ".join(
+            f"({i}, 'user {i}', \"person{i}@example.com\")" for i in range(1, 2001)
+        )
+        got = self.run_commands([
+            f"insert into users values {values};",
+            "INSERT 2001 user2001 person2001@example.com",
+            "select where username = 'user 1500'",
+            "select * where email = person2001@example.com",
+            "select where id = 7 limit 0",
+            "select limit 2",
+            "insert values (2002, 'a', 'b'), (2003, 'unterminated)",
+            "insert values (2002, 'a', 'b'),",
+            "insert 2002 a b c",
+            "insert '2002 a b",
+            "insert into users 2002 a b",
+            "select where name = 'x'",
+            "select limit -1",
+            "begin now",
+            ".exit",
+        ])
+        self.assertEqual(got, [
+            "db> Executed.",
+            "db> Executed.",
+            "db> (1500, user 1500, person1500@example.com)",
+            "Executed.",
+            "db> (2001, user2001, person2001@example.com)",
+            "Executed.",
+            "db> Executed.",
+            "db> (1, user 1, person1@example.com)",
+            "(2, user 2, person2@example.com)",
+            "Executed.",
+            "db> Syntax error. Could not parse statement 'insert values (2002, 'a', 'b'), (2003, 'unterminated)'",
+            "db> Syntax error. Could not parse statement 'insert values (2002, 'a', 'b'),'",
+            "db> Syntax error. Could not parse statement 'insert 2002 a b c'",
+            "db> Syntax error. Could not parse statement 'insert '2002 a b'",
+            "db> Syntax error. Could not parse statement 'insert into users 2002 a b'",
+            "db> Syntax error. Could not parse statement 'select where name = 'x''",
+            "db> Syntax error. Could not parse statement 'select limit -1'",
+            "db> Syntax error. Could not parse statement 'begin now'",
+            "db> ",
+        ])
+
+    def test_like_filters(self):
+        long_name = "n" * 32
+        long_email = "e" * 250 + "@x.io"
+        values = ", ".join(
+            f"({i}, 'user{i}', 'user{i}@{'a' if i % 2 else 'b'}.com')" for i in range(1, 41)
+        )
+        got = self.run_commands([
+            f"insert into users values {values};",
+            f"insert 41 {long_name} {long_email}",
+            "select where username = 'user1'",
+            "select where email like 'user3%' limit 3",
+            "select where email like 'user1@a.com'",
+            f"select where username like '{long_name[:20]}%'",
+            f"select where email = '{long_email}'",
+            f"select where username = '{long_name}x'",
+            "select where email like '%' limit 1",
+            "select where username like 'user_%'",
+            "select where email like '%.com'",
+            "select where id like '1%'",
+            ".exit",
+        ])
+        self.assertEqual(got, [
+            "db> Executed.",
+            "db> Executed.",
+            "db> (1, user1, user1@a.com)",
+            "Executed.",
+            "db> (3, user3, user3@a.com)",
+            "(30, user30, user30@b.com)",
+            "(31, user31, user31@a.com)",
+            "Executed.",
+            "db> (1, user1, user1@a.com)",
+            "Executed.",
+            f"db> (41, {long_name}, {long_email})",
+            "Executed.",
+            f"db> (41, {long_name}, {long_email})",
+            "Executed.",
+            "db> Executed.",
+            "db> (1, user1, user1@a.com)",
+            "Executed.",
+            "db> Syntax error. Could not parse statement 'select where username like 'user_%''",
+            "db> Syntax error. Could not parse statement 'select where email like '%.com''",
+            "db> Syntax error. Could not parse statement 'select where id like '1%''",
+            "db> ",
+        ])
+
+    def test_order_by(self):
+        # Usernames repeat so ties fall back to id order; a 1 KiB budget
+        # spills a run every few rows and merges them in several passes.
+        rows = [(i, f"user{(i * 7) % 150}", f"{(i * 31) % 1000}@example.com")
+                for i in range(1, 1001)]
+        values = ", ".join(f"({i}, '{u}', '{e}')" for i, u, e in rows)
+        by_username = sorted(rows, key=lambda r: (r[1], r[0]))
+        by_email = sorted(rows, key=lambda r: (r[2], r[0]))
+        fmt = lambda rs: [f"({i}, {u}, {e})" for i, u, e in rs]
+
+        got = self.run_commands([
+            f"insert into users values {values};",
+            "select order by username limit 5",
+            "select where username like 'user1%' order by email limit 0",
+            ".sort_memory 1",
+            ".sort_memory",
+            "select order by username",
+            "select where email like '1%' order by email limit 20",
+            "select order by id limit 1",
+            "select order by name",
+            ".sort_memory 0",
+            ".exit",
+        ])
+        self.assertEqual(got, [
+            "db> Executed.",
+            "db> " + fmt(by_username[:5])[0],
+            *fmt(by_username[1:5]),
+            "Executed.",
+            "db> Executed.",
+            "db> db> Sort memory: 1 KiB",
+            "db> " + fmt(by_username)[0],
+            *fmt(by_username[1:]),
+            "Executed.",
+            "db> " + fmt([r for r in by_email if r[2].startswith("1")][:1])[0],
+            *fmt([r for r in by_email if r[2].startswith("1")][1:20]),
+            "Executed.",
+            "db> (1, user7, 31@example.com)",
+            "Executed.",
+            "db> Syntax error. Could not parse statement 'select order by name'",
+            "db> Usage: .sort_memory [KiB]",
+            "db> ",
+        ])
+
+    def test_backup(self):
+        backup = self.TEST_DB + ".backup"
+        self.addCleanup(lambda: os.path.exists(backup) and os.remove(backup))
+        for args in [[], ["--compress"]]:
+            if os.path.exists(self.TEST_DB):
+                os.remove(self.TEST_DB)
+            values = ", ".join(f"({i}, 'user{i}', 'person{i}@example.com')" for i in range(1, 301))
+            got = self.run_commands([
+                f"insert values {values}",
+                "begin",
+                "insert 301 user301 person301@example.com",
+                f".backup {backup}",
+                "commit",
+                f".backup {backup}",
+                "insert 302 user302 person302@example.com",
+                f".backup {self.TEST_DB}.missing/backup",
+                ".exit",
+            ], args)
+            self.assertEqual(got, [
+                "db> Executed.",
+                "db> Executed.",
+                "db> Executed.",
+                "db> Error: Cannot back up while a transaction is open.",
+                "db> Executed.",
+                "db> db> Executed.",
+                f"db> Error: Could not back up to '{self.TEST_DB}.missing/backup': No such file or directory.",
+                "db> ",
+            ])
+            self.assertFalse(os.path.exists(backup + "-wal"))
+
+            # The copy opens on its own, with the rows committed before it.
+            os.replace(backup, self.TEST_DB)
+            got = self.run_commands(["select where id = 301", "select where id = 302", ".exit"])
+            self.assertEqual(got, [
+                "db> (301, user301, person301@example.com)",
+                "Executed.",
+                "db> Executed.",
+                "db> ",
+            ])
+
+    def test_legacy_node_header(self):
+        # Pages from before the versioned header: a 4-byte type, a bool and
+        # an 8-byte parent. A root internal node over two leaves.
+        def header(node_type, is_root, parent):
+            return struct.pack("<I?Q", node_type, is_root, parent)
+
+        def leaf(parent, ids, next_leaf):
+            page = header(1, False, parent) + struct.pack("<II", len(ids), next_leaf)
+            for i in ids:
+                page += struct.pack("<II", i, i)
+                page += f"user{i}".encode().ljust(33, b"\0")
+                page += f"person{i}@example.com".encode().ljust(256, b"\0")
+            return page.ljust(4096, b"\0")
+
+        root = header(0, True, 0) + struct.pack("<IIII", 1, 2, 1, 3)
+        pages = [root.ljust(4096, b"\0"), leaf(0, [1, 3], 2), leaf(0, [5], 0)]
+        with open(self.TEST_DB, "wb") as f:
+            f.write(b"".join(pages))
+
+        got = self.run_commands(["select", "insert 4 user4 person4@example.com", ".exit"])
+        self.assertEqual(got, [
+            "db> (1, user1, person1@example.com)",
+            "(3, user3, person3@example.com)",
+            "(5, user5, person5@example.com)",
+            "Executed.",
+            "db> Executed.",
+            "db> ",
+        ])
+        with open(self.TEST_DB, "rb") as f:
+            data = f.read()
+        # type, is_root, version, reserved, parent; then num_cells and
+        # next_leaf of the first leaf.
+        self.assertEqual(data[:8], bytes([0, 1, 1, 0, 0, 0, 0, 0]))
+        self.assertEqual(data[4096:4112], struct.pack("<BBBBIII", 1, 0, 1, 0, 0, 2, 2))
+
+    def test_batch_insert_into_inner_leaves(self):
+        # Every tenth id one at a time fills several levels of the small
+        # DEBUG internal nodes. The batches then split leaves in the middle
+        # of the tree, several ways at once, under full internal nodes, so
+        # the parents split while the new leaves are being linked.
+        ids = list(range(10, 1210, 10))
+        commands = [f"insert {i} user{i} person{i}@example.com" for i in ids]
+        for start, step, count in [(41, 1, 60), (301, 7, 30), (302, 7, 30), (601, 3, 40), (5, 7, 30)]:
+            batch = [i for i in range(start, 1210, step) if i % 10 != 0][:count]
+            batch = [i for i in batch if i not in ids]
+            ids += batch
+            values = ", ".join(
+                f"({i}, 'user{i}', 'person{i}@example.com')" for i in reversed(batch)
+            )
+            commands.append(f"insert values {values}")
+        commands.append("select")
+        commands += [f"select where id = {i}" for i in ids]
+        commands.append(".exit")
+
+        got = self.run_commands(commands)
+        rows = {i: f"({i}, user{i}, person{i}@example.com)" for i in ids}
+        select_at = len(commands) - len(ids) - 2
+        self.assertEqual(got[:select_at], ["db> Executed."] * select_at)
+        self.assertEqual(
+            got[select_at:select_at + len(ids) + 1],
+            ["db> " + rows[min(ids)], *[rows[i] for i in sorted(ids)[1:]], "Executed."],
+        )
+        lookups = got[select_at + len(ids) + 1:-1]
+        self.assertEqual(lookups, [line for i in ids for line in ["db> " + rows[i], "Executed."]])
+
+    def test_batch_insert_duplicates(self):
+        commands = [
+            f"insert {i} user{i} person{i}@example.com"
+            for i in range(1, 31)
+        ]
+        commands += [
+            # 20 is in a leaf other than the root.
+            "insert 20 again again@example.com",
+            "insert values (40, 'a', 'a'), (35, 'b', 'b'), (31, 'c', 'c')",
+            "insert values (50, 'd', 'd'), (50, 'e', 'e')",
+            # 5 is taken, so neither 45 nor 2 is inserted.
+            "insert values (45, 'f', 'f'), (2, 'g', 'g'), (5, 'h', 'h')",
+            "select where id = 20",
+            "select where username = 'again'",
+            "select where id = 45",
+            "select where id = 50",
+            "select where username = 'g'",
+            ".exit",
+        ]
+        got = self.run_commands(commands)
+        self.assertEqual(got[30:], [
+            "db> Error: Duplicate key.",
+            "db> Executed.",
+            "db> Error: Duplicate key.",
+            "db> Error: Duplicate key.",
+            "db> (20, user20, person20@example.com)",
+            "Executed.",
+            "db> Executed.",
+            "db> Executed.",
+            "db> Executed.",
+            "db> Executed.",
+            "db> ",
+        ])